@@ -0,0 +1,66 @@
+/*
+   ChangeQueue.c: Lock-free multiple producer, single consumer change list
+*/
+
+#include <global.h>
+
+#include <ChangeQueue.h>
+#include <atomic.h>
+#include <xmalloc.h>
+
+struct _ChangeQueue {
+	/* Most recently pushed change first */
+	Change head;
+};
+
+ChangeQueue changequeue_create(void)
+{
+	ChangeQueue q = NEW(ChangeQueue);
+
+	q->head = NULL;
+
+	return q;
+}
+
+void changequeue_destroy(ChangeQueue q)
+{
+	Change c, t;
+
+	for(c = changequeue_take(q); c != NULL; c = t) {
+		t = c->l;
+		xfree(c);
+	}
+
+	xfree(q);
+}
+
+void changequeue_push(ChangeQueue q, int fd, mevent_t event, mmode_t mode, mchange_t op)
+{
+	Change c = NEW(Change);
+
+	c->fd = fd;
+	c->event = event;
+	c->mode = mode;
+	c->op = op;
+
+	c->l = ATOMIC_LOAD(&q->head);
+	while(!ATOMIC_CAS(&q->head, &c->l, c));
+}
+
+Change changequeue_take(ChangeQueue q)
+{
+	Change c, t, ret = NULL;
+
+	/* Since the whole list is detached at once there's no ABA problem */
+	c = ATOMIC_XCHG(&q->head, NULL);
+
+	/* Reverse it into the order the changes were made */
+	while(c != NULL) {
+		t = c->l;
+		c->l = ret;
+		ret = c;
+		c = t;
+	}
+
+	return ret;
+}
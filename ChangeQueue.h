@@ -0,0 +1,40 @@
+/* Change queues
+
+   Multiplexer backends which can't be modified while another thread is
+   polling (poll, select and /dev/poll) have registration changes posted to
+   a change queue instead.  Any number of threads may push changes without
+   locking; the polling thread takes the whole queue at once and applies
+   the changes in the order they were pushed. */
+
+#ifndef CHANGEQUEUE_H
+#define CHANGEQUEUE_H
+
+#include <Multiplexer.h>
+
+typedef enum {
+	MCHANGE_ADD,
+	MCHANGE_REARM,
+	MCHANGE_REMOVE
+} mchange_t;
+
+typedef struct _Change {
+	int fd;
+	mevent_t event;
+	mmode_t mode;
+	mchange_t op;
+
+	struct _Change *l;
+} *Change;
+
+typedef struct _ChangeQueue *ChangeQueue;
+
+ChangeQueue changequeue_create(void);
+void changequeue_destroy(ChangeQueue q);
+
+void changequeue_push(ChangeQueue q, int fd, mevent_t event, mmode_t mode, mchange_t op);
+
+/* Detach every pending change, oldest first.  The caller frees each one
+   with xfree() */
+Change changequeue_take(ChangeQueue q);
+
+#endif
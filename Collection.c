@@ -202,30 +202,20 @@ void *collection_remove(Collection table, CollectionKey key)
 	return ret;
 }
 
+/* Lookups don't reorder the chain, since they're done under read locks by
+   several threads at once */
 void *collection_lookup(Collection table, CollectionKey key)
 {
-	unsigned i = key % table->n_buckets;
-	HashNode n = NULL, o = table->buckets[i];
+	HashNode o = table->buckets[key % table->n_buckets];
 
 	while(o) {
-		if(key == o->key) {
-			if(o != table->buckets[i]) {
-				n->next = o->next;
-				o->next = table->buckets[i];
-				table->buckets[i] = o;
-			}
-
-			break;
-		}
+		if(key == o->key)
+			return o->data;
 
-		n = o;
 		o = o->next;
 	}
 
-	if(!o)
-		return NULL;
-
-	return o->data;
+	return NULL;
 }
 
 void collection_iterate(Collection table, int (*iterator)(CollectionKey, void *, void *), void *ptr)
@@ -1,14 +1,22 @@
 #include <global.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
+#include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 #include <time.h>
 #include <unistd.h>
 
-#include <Collection.h>
+#include <Config.h>
 #include <ConnectionManager.h>
+#include <Multiplexer.h>
 #include <Permissions.h>
 #include <RCL.h>
+#include <admission.h>
+#include <atomic.h>
+#include <epoch.h>
 #include <hlid.h>
+#include <log.h>
 #include <output.h>
 #include <xmalloc.h>
 
@@ -19,7 +27,8 @@ typedef struct _Connection {
 	/* Connection state */
 	cstate_t cstate;
 
-	/* Current server task number */
+	/* Next task number for requests sent to the client.  Drawn with an
+	   atomic add, without locking the connection */
 	uint32_t taskno;
 
 	/* User icon */
@@ -40,37 +49,245 @@ typedef struct _Connection {
 	/* Permissions */
 	Permissions perms;
 
+	/* Multiplexer of the event loop which owns the connection */
+	Multiplexer mplx;
+
+	/* Incoming transactions */
+	TransactionBuffer input;
+
+	/* Held while writing to the connection, with the connection locked
+	   for reading, so writers don't need it locked for writing.  Guards
+	   the output queue and the flags below */
+	pthread_mutex_t output_lock;
+
+	/* Outgoing transactions the socket hasn't taken yet */
+	TransactionQueue output;
+
+	/* Set while the event loop is waiting to flush the output queue */
+	int flushing;
+
+	/* Set while reading is paused until the output queue drains, and
+	   stalled once input is waiting to be rearmed because of it */
+	int paused, stalled;
+
+	/* Set once the connection is on its way out for falling behind or
+	   failing a write */
+	int closing;
+
 	/* Connection lock */
 	RCL lock;
 } *Connection;
 
-static RCL cm_lock = NULL;
-static Collection ctbl = NULL;
+/* What to do with a connection whose output queue reaches the high
+   watermark */
+typedef enum {
+	SLOW_DROP,		/* Discard anything sent to it which isn't a
+				   reply */
+	SLOW_DISCONNECT,	/* Disconnect it */
+	SLOW_PAUSE		/* Discard as with SLOW_DROP, and stop reading
+				   from it until the queue has drained to the
+				   low watermark */
+} slow_policy_t;
+
+/* Keeps neighbouring slots' readers and writers apart */
+#define CACHE_LINE	64
+
+/* Slots the table starts with.  Doubled whenever a descriptor doesn't fit */
+#define SLAB_INITIAL	256
+
+/* A connection's place in the table.  The generation is odd while the slot
+   holds a connection, and moves on whenever one is added or removed, so a
+   uid and a generation together name a single connection */
+typedef struct _ConnSlot {
+	Connection c;
+	unsigned long gen;
+} ConnSlot;
+
+/* Connections, indexed by uid, which is always the connection's
+   descriptor.  Readers find their way in without any lock, under
+   epoch_enter().  A slab that's been outgrown is replaced by a bigger copy,
+   and freed once nobody can still be reading it */
+typedef struct _ConnSlab {
+	int size;
+
+	ConnSlot *slots;
+	void *memory;
+} *ConnSlab;
+
+/* Held by cm_add() and cm_remove().  Nobody else locks the table */
+static pthread_mutex_t cm_lock = PTHREAD_MUTEX_INITIALIZER;
+static ConnSlab slab = NULL;
+
+/* One past the highest uid there's been a connection on, which walks stop
+   at, and the number of connections */
+static int slab_top = 0, slab_count = 0;
+
+/* Bytes in every output queue, for a measure of how much memory they're
+   taking up */
+static int output_total = 0;
+
+static uint32_t output_high = DEFAULT_OUTPUT_HIGH_WATERMARK;
+static uint32_t output_low = DEFAULT_OUTPUT_HIGH_WATERMARK / 4;
+static slow_policy_t slow_policy = SLOW_PAUSE;
+
+static void cm_slab_free(void *ptr)
+{
+	ConnSlab s = (ConnSlab)ptr;
+
+	xfree(s->memory);
+	xfree(s);
+}
+
+/* A slab of size slots starting with a copy of old, if there is one */
+static ConnSlab cm_slab_create(int size, ConnSlab old)
+{
+	ConnSlab s = NEW(ConnSlab);
+	int i = 0;
+
+	s->size = size;
+
+	/* Start the slots on a cache line boundary */
+	s->memory = xmalloc(sizeof(ConnSlot) * size + CACHE_LINE);
+	s->slots = (ConnSlot *)(((uintptr_t)s->memory + CACHE_LINE - 1) & ~(uintptr_t)(CACHE_LINE - 1));
+
+	if(old != NULL)
+		for(; i < old->size; i++)
+			s->slots[i] = old->slots[i];
+
+	for(; i < size; i++) {
+		s->slots[i].c = NULL;
+		s->slots[i].gen = 0;
+	}
+
+	return s;
+}
 
 void cm_init(void)
 {
-	if(cm_lock == NULL)
-		cm_lock = rcl_create();
+	char *t;
+	int v;
+
+	pthread_mutex_lock(&cm_lock);
+
+	if(slab == NULL)
+		ATOMIC_STORE(&slab, cm_slab_create(SLAB_INITIAL, NULL));
 
-	if(ctbl == NULL)
-		ctbl = collection_create();
+	pthread_mutex_unlock(&cm_lock);
+
+	if((v = config_int_value("global", "output_high_watermark")) > 0)
+		output_high = v;
+	else
+		output_high = DEFAULT_OUTPUT_HIGH_WATERMARK;
+
+	if((v = config_int_value("global", "output_low_watermark")) >= 0 && v < (int)output_high)
+		output_low = v;
+	else
+		output_low = output_high / 4;
+
+	slow_policy = SLOW_PAUSE;
+
+	if((t = config_value("global", "slow_clients")) != NULL) {
+		if(!strcasecmp(t, "drop"))
+			slow_policy = SLOW_DROP;
+		else if(!strcasecmp(t, "disconnect"))
+			slow_policy = SLOW_DISCONNECT;
+		else if(strcasecmp(t, "pause"))
+			log("!!! Warning: Unknown slow_clients policy \"%s\", pausing instead", t);
+
+		xfree(t);
+	}
+}
+
+static void cm_connection_free(void *ptr)
+{
+	Connection c = (Connection)ptr;
+
+	pthread_mutex_destroy(&c->output_lock);
+	rcl_destroy(c->lock);
+	xfree(c);
 }
 
 void cm_shutdown(void)
 {
-	rcl_write_lock(cm_lock);
+	pthread_mutex_lock(&cm_lock);
 
-	/* XXX Free the connection table here */
-	collection_destroy(ctbl, NULL);
+	/* XXX Free the connections here */
+	if(slab != NULL)
+		epoch_retire(ATOMIC_XCHG(&slab, NULL), cm_slab_free);
 
-	rcl_destroy(cm_lock);
+	pthread_mutex_unlock(&cm_lock);
 }
 
-void cm_add(int fd, uint32_t ip)
+/* The slot for uid in the current slab, or NULL if it's out of range */
+static inline ConnSlot *cm_slot(int uid)
 {
+	ConnSlab s = ATOMIC_LOAD(&slab);
+
+	if(s == NULL || uid < 0 || uid >= s->size)
+		return NULL;
+
+	return &s->slots[uid];
+}
+
+/* Find the connection on uid and lock it for reading, or for writing if
+   write is set.  Returns NULL if there's no such connection, or it's gone
+   by the time it's locked.  Otherwise the caller is inside epoch_enter()
+   until it calls cm_put() */
+static Connection cm_get(int uid, int write)
+{
+	ConnSlot *slot;
 	Connection c;
+	unsigned long gen;
+
+	epoch_enter();
 
-	rcl_write_lock(cm_lock);
+	/* The slot may be changing under us, so go again until the
+	   connection and the generation agree */
+	do {
+		if((slot = cm_slot(uid)) == NULL || !((gen = ATOMIC_LOAD(&slot->gen)) & 1)) {
+			epoch_exit();
+			return NULL;
+		}
+
+		c = ATOMIC_LOAD(&slot->c);
+	} while(c == NULL || ATOMIC_LOAD(&slot->gen) != gen);
+
+	if(write)
+		rcl_write_lock(c->lock);
+	else
+		rcl_read_lock(c->lock);
+
+	/* cm_remove() moves the generation on before it locks the connection
+	   to take it apart, so once we hold the lock this tells us whether
+	   it has.  The slab may have grown meanwhile */
+	if((slot = cm_slot(uid)) == NULL || ATOMIC_LOAD(&slot->gen) != gen) {
+		if(write)
+			rcl_write_unlock(c->lock);
+		else
+			rcl_read_unlock(c->lock);
+
+		epoch_exit();
+		return NULL;
+	}
+
+	return c;
+}
+
+static void cm_put(Connection c, int write)
+{
+	if(write)
+		rcl_write_unlock(c->lock);
+	else
+		rcl_read_unlock(c->lock);
+
+	epoch_exit();
+}
+
+void cm_add(int fd, uint32_t ip, Multiplexer m)
+{
+	Connection c;
+	ConnSlab s;
+	int size;
 
 	c = NEW(Connection);
 	c->ip = ip;
@@ -82,25 +299,58 @@ void cm_add(int fd, uint32_t ip)
 	c->login = NULL;
 	c->nickname = xstrdup("");
 	c->perms = NULL;
+	c->mplx = m;
+	c->input = transaction_buffer_create();
+	c->output = transaction_queue_create();
+	pthread_mutex_init(&c->output_lock, NULL);
+	c->flushing = c->paused = c->stalled = c->closing = 0;
 	c->lock = rcl_create();
 
-	collection_insert(ctbl, fd, c);
+	pthread_mutex_lock(&cm_lock);
+
+	if(fd >= (s = slab)->size) {
+		for(size = s->size * 2; fd >= size; size *= 2);
+
+		ATOMIC_STORE(&slab, cm_slab_create(size, s));
+		epoch_retire(s, cm_slab_free);
+	}
+
+	s = slab;
+
+	/* Published before the generation says it's there */
+	ATOMIC_STORE(&s->slots[fd].c, c);
+	ATOMIC_ADD(&s->slots[fd].gen, 1);
+
+	if(fd >= slab_top)
+		ATOMIC_STORE(&slab_top, fd + 1);
 
-	rcl_write_unlock(cm_lock);
+	ATOMIC_ADD(&slab_count, 1);
+
+	pthread_mutex_unlock(&cm_lock);
 }
 
 void cm_remove(int uid)
 {
+	ConnSlot *slot;
 	Connection c;
 
-	rcl_write_lock(cm_lock);
+	pthread_mutex_lock(&cm_lock);
 
-	if((c = collection_remove(ctbl, uid)) == NULL) {
-		rcl_write_unlock(cm_lock);
+	if((slot = cm_slot(uid)) == NULL || (c = slot->c) == NULL) {
+		pthread_mutex_unlock(&cm_lock);
 		return;
 	}
 
-	rcl_write_unlock(cm_lock);
+	/* Anyone who locks the connection from here on finds it's gone */
+	ATOMIC_ADD(&slot->gen, 1);
+	ATOMIC_STORE(&slot->c, NULL);
+	ATOMIC_SUB(&slab_count, 1);
+
+	pthread_mutex_unlock(&cm_lock);
+
+	adm_release(c->ip);
+
+	/* Wait for whoever found it before then */
 	rcl_write_lock(c->lock);
 
 	if(c->login != NULL)
@@ -111,34 +361,37 @@ void cm_remove(int uid)
 	if(c->perms != NULL)
 		permissions_destroy(c->perms);
 
-	rcl_destroy(c->lock);
+	transaction_buffer_destroy(c->input);
+	ATOMIC_SUB(&output_total, (int)transaction_queue_length(c->output));
+	transaction_queue_destroy(c->output);
+
+	rcl_write_unlock(c->lock);
+
+	/* Forget the descriptor before its number can be reused */
+	multiplexer_remove(c->mplx, uid, MPLX_RD);
+	multiplexer_remove(c->mplx, uid, MPLX_WR);
 	close(uid);
-	xfree(c);
+
+	epoch_retire(c, cm_connection_free);
 }
 
-int cm_user_count(void)
+int cm_output_bytes(void)
 {
-	int ret;
-	
-	rcl_read_lock(cm_lock);
-	ret = collection_size(ctbl);
-	rcl_read_unlock(cm_lock);
+	return ATOMIC_LOAD(&output_total);
+}
 
-	return ret;
+int cm_user_count(void)
+{
+	return ATOMIC_LOAD(&slab_count);
 }
 
 int cm_getval(int uid, conn_member_t mid, void *ptr)
 {
 	Connection c;
 
-	rcl_read_lock(cm_lock);
-
-	if((c = collection_lookup(ctbl, uid)) == NULL) {
-		rcl_read_unlock(cm_lock);
+	if((c = cm_get(uid, 0)) == NULL)
 		return -1;
-	}
 
-	rcl_read_lock(c->lock);
 
 	switch(mid) {
 		case CONN_IP:
@@ -148,7 +401,7 @@ int cm_getval(int uid, conn_member_t mid, void *ptr)
 			memcpy(ptr, &c->cstate, sizeof(cstate_t));
 			break;
 		case CONN_TASKNO:
-			memcpy(ptr, &c->taskno, sizeof(cstate_t));
+			*(uint32_t *)ptr = ATOMIC_LOAD(&c->taskno);
 			break;
 		case CONN_ICON:
 			memcpy(ptr, &c->icon, 2);
@@ -167,24 +420,41 @@ int cm_getval(int uid, conn_member_t mid, void *ptr)
 			break;
 	}
 
-	rcl_read_unlock(c->lock);
-	rcl_read_unlock(cm_lock);
+	cm_put(c, 0);
 
 	return 0;
 }
 
-int cm_setval(int uid, conn_member_t mid, void *ptr)
+int cm_snapshot(int uid, struct conn_view *v)
 {
 	Connection c;
 
-	rcl_read_lock(cm_lock);
+	if((c = cm_get(uid, 0)) == NULL)
+		return -1;
+
+	v->ip = c->ip;
+	v->cstate = c->cstate;
+	v->icon = c->icon;
+	v->status = c->status;
+	v->last_activity = c->last_activity;
+
+	if((v->has_perms = c->perms != NULL))
+		memcpy(&v->perms, c->perms, sizeof(struct _Permissions));
+
+	strcpy(v->nickname, c->nickname);
+
+	cm_put(c, 0);
+
+	return 0;
+}
+
+int cm_setval(int uid, conn_member_t mid, void *ptr)
+{
+	Connection c;
 
-	if((c = collection_lookup(ctbl, uid)) == NULL) {
-		rcl_read_unlock(cm_lock);
+	if((c = cm_get(uid, 1)) == NULL)
 		return -1;
-	}
 
-	rcl_write_lock(c->lock);
 
 	switch(mid) {
 		case CONN_IP:
@@ -194,7 +464,7 @@ int cm_setval(int uid, conn_member_t mid, void *ptr)
 			memcpy(&c->cstate, ptr, sizeof(cstate_t));
 			break;
 		case CONN_TASKNO:
-			memcpy(&c->taskno, ptr, 4);
+			ATOMIC_STORE(&c->taskno, *(uint32_t *)ptr);
 			break;
 		case CONN_ICON:
 			memcpy(&c->icon, ptr, 4);
@@ -214,11 +484,13 @@ int cm_setval(int uid, conn_member_t mid, void *ptr)
 		case CONN_NICKNAME:
 			xfree(c->nickname);
 			c->nickname = xstrdup((char *)ptr);
+
+			if(strlen(c->nickname) > MAX_NICKNAME_LEN)
+				c->nickname[MAX_NICKNAME_LEN] = '\0';
 			break;
 	}
 
-	rcl_write_unlock(c->lock);
-	rcl_read_unlock(cm_lock);
+	cm_put(c, 1);
 
 	return 0;
 }
@@ -238,43 +510,205 @@ int cm_set_cstate(int uid, cstate_t s)
 	return cm_setval(uid, CONN_CSTATE, &s);
 }
 
-int32_t cm_get_taskno(int uid)
+Multiplexer cm_get_multiplexer(int uid)
 {
-	int32_t ret;
+	Multiplexer ret;
 	Connection c;
 
-	rcl_read_lock(cm_lock);
+	if((c = cm_get(uid, 0)) == NULL)
+		return NULL;
+
+	ret = c->mplx;
+	cm_put(c, 0);
 
-	if((c = collection_lookup(ctbl, uid)) == NULL) {
-		rcl_read_unlock(cm_lock);
+	return ret;
+}
+
+int cm_input_fill(int uid)
+{
+	int ret;
+	Connection c;
+
+	if((c = cm_get(uid, 1)) == NULL)
 		return -1;
+
+	ret = transaction_buffer_fill(c->input, uid) != 0;
+	cm_put(c, 1);
+
+	return ret;
+}
+
+/* Watch a connection for input again, unless reading is paused */
+void cm_input_rearm(int uid)
+{
+	Connection c;
+
+	if((c = cm_get(uid, 0)) == NULL)
+		return;
+
+	pthread_mutex_lock(&c->output_lock);
+
+	/* Flushing the queue will rearm it */
+	if(c->paused)
+		c->stalled = 1;
+	else
+		multiplexer_rearm(c->mplx, uid, MPLX_RD);
+
+	pthread_mutex_unlock(&c->output_lock);
+	cm_put(c, 0);
+}
+
+TransactionBuffer cm_input_take(int uid)
+{
+	TransactionBuffer ret;
+	Connection c;
+
+	if((c = cm_get(uid, 1)) == NULL)
+		return NULL;
+
+	ret = transaction_buffer_split(c->input);
+	cm_put(c, 1);
+
+	return ret;
+}
+
+/* Have the event loop find the connection unreadable, so it's disconnected
+   the same way as if the peer had closed it.  Called with output_lock
+   held */
+static void cm_output_close(int uid, Connection c)
+{
+	c->closing = 1;
+	c->paused = 0;
+	shutdown(uid, SHUT_RDWR);
+
+	if(c->stalled) {
+		c->stalled = 0;
+		multiplexer_rearm(c->mplx, uid, MPLX_RD);
 	}
+}
 
-	rcl_write_lock(c->lock);
-	ret = c->taskno++;
-	rcl_write_unlock(c->lock);
-	rcl_read_unlock(cm_lock);
+/* Write to a connection which is locked for reading, with t stamped with
+   the given task number unless it's a reply */
+static int cm_output(int uid, Connection c, TransactionOut t, uint32_t taskno)
+{
+	int ret = 0, queued, before;
+
+	pthread_mutex_lock(&c->output_lock);
+
+	if(c->closing) {
+		ret = -1;
+		goto done;
+	}
+
+	if(transaction_queue_length(c->output) >= output_high) {
+		if(slow_policy == SLOW_DISCONNECT) {
+#ifdef DEBUG
+			debug("*** Output queue for %d is full, disconnecting", uid);
+#endif
+			cm_output_close(uid, c);
+			ret = -1;
+			goto done;
+		}
+
+		/* The client is waiting for its replies, so only the rest
+		   is discarded */
+		if(!transaction_is_reply(t))
+			goto done;
+	}
+
+	before = transaction_queue_length(c->output);
+
+	if((queued = transaction_queue_write(c->output, uid, t, taskno)) < 0) {
+		cm_output_close(uid, c);
+		ret = -1;
+		goto done;
+	}
+
+	ATOMIC_ADD(&output_total, queued - before);
+
+	if(queued > 0 && !c->flushing) {
+		c->flushing = 1;
+		multiplexer_add_mode(c->mplx, uid, MPLX_WR, MPLX_ONESHOT);
+	}
+
+	if(slow_policy == SLOW_PAUSE && queued >= output_high)
+		c->paused = 1;
+
+done:
+	pthread_mutex_unlock(&c->output_lock);
+
+	return ret;
+}
+
+/* The next task number for a request to c.  Numbers may be skipped if a
+   request is then dropped, which clients don't mind */
+static inline uint32_t cm_taskno(Connection c)
+{
+	return ATOMIC_ADD(&c->taskno, 1) - 1;
+}
+
+int cm_transaction_write(int uid, TransactionOut t)
+{
+	int ret;
+	Connection c;
+
+	if((c = cm_get(uid, 0)) == NULL)
+		return -1;
+
+	ret = cm_output(uid, c, t, transaction_is_reply(t) ? 0 : cm_taskno(c));
+	cm_put(c, 0);
 
 	return ret;
 }
 
+void cm_output_flush(int uid)
+{
+	int queued, before;
+	Connection c;
+
+	if((c = cm_get(uid, 0)) == NULL)
+		return;
+
+	pthread_mutex_lock(&c->output_lock);
+
+	before = transaction_queue_length(c->output);
+
+	if((queued = transaction_queue_flush(c->output, uid)) < 0)
+		cm_output_close(uid, c);
+	else
+		ATOMIC_ADD(&output_total, queued - before);
+
+	if(queued > 0)
+		multiplexer_rearm(c->mplx, uid, MPLX_WR);
+	else {
+		c->flushing = 0;
+		multiplexer_remove(c->mplx, uid, MPLX_WR);
+	}
+
+	if(c->paused && queued <= (int)output_low) {
+		c->paused = 0;
+
+		if(c->stalled) {
+			c->stalled = 0;
+			multiplexer_rearm(c->mplx, uid, MPLX_RD);
+		}
+	}
+
+	pthread_mutex_unlock(&c->output_lock);
+	cm_put(c, 0);
+}
+
 Permissions cm_perm_getall(int uid)
 {
 	Connection c;
 	Permissions ret = NULL;
 
-	rcl_read_lock(cm_lock);
-
-	if((c = collection_lookup(ctbl, uid)) == NULL) {
-		rcl_read_unlock(cm_lock);
+	if((c = cm_get(uid, 0)) == NULL)
 		return NULL;
-	}
 
-	rcl_read_lock(c->lock);
 	if(c->perms != NULL)
 		ret = permissions_copy(c->perms);
-	rcl_read_unlock(c->lock);
-	rcl_read_unlock(cm_lock);
+	cm_put(c, 0);
 
 	return ret;
 }
@@ -283,20 +717,14 @@ int cm_perm_setall(int uid, Permissions p)
 {
 	Connection c;
 
-	rcl_read_lock(cm_lock);
-
-	if((c = collection_lookup(ctbl, uid)) == NULL) {
-		rcl_read_unlock(cm_lock);
+	if((c = cm_get(uid, 1)) == NULL)
 		return -1;
-	}
 
-	rcl_write_lock(c->lock);
 	if(c->perms != NULL)
 		permissions_destroy(c->perms);
 
 	c->perms = permissions_copy(p);
-	rcl_write_unlock(c->lock);
-	rcl_read_unlock(cm_lock);
+	cm_put(c, 1);
 
 	return 0;
 }
@@ -306,20 +734,14 @@ int cm_perm_check(int uid, int field)
 	int ret = -1;
 	Connection c;
 
-	rcl_read_lock(cm_lock);
-
-	if((c = collection_lookup(ctbl, uid)) == NULL) {
-		rcl_read_unlock(cm_lock);
+	if((c = cm_get(uid, 0)) == NULL)
 		return -1;
-	}
 
-	rcl_read_lock(c->lock);
 
 	if(c->perms != NULL)  
 		ret = permissions_check_field(c->perms, field);
 
-	rcl_read_unlock(c->lock);
-	rcl_read_unlock(cm_lock);
+	cm_put(c, 0);
 
 	return ret;
 }
@@ -329,14 +751,9 @@ int cm_perm_set(int uid, int field, int value)
 	int ret = 0;
 	Connection c;
 
-	rcl_read_lock(cm_lock);
-
-	if((c = collection_lookup(ctbl, uid)) == NULL) {
-		rcl_read_unlock(cm_lock);
+	if((c = cm_get(uid, 1)) == NULL)
 		return -1;
-	}
 
-	rcl_write_lock(c->lock);
 
 	if(c->perms == NULL)
 		ret = -1;
@@ -345,79 +762,76 @@ int cm_perm_set(int uid, int field, int value)
 	else
 		permissions_unset_field(c->perms, field);
 
-	rcl_write_unlock(c->lock);
-	rcl_read_unlock(cm_lock);
+	cm_put(c, 1);
 
 	return ret;
 }
 
-struct cm_iterator_data {
-	int (*iterator)(int uid, void *ptr);
-	void *ptr;
-};
-
-static int cm_iterator(CollectionKey key, void *data, void *ptr)
+/* Whether a walk through slab s should visit uid.  Walks go through the
+   slots in order, so this is cheap to check before anything is locked */
+static inline int cm_occupied(ConnSlab s, int uid)
 {
-	struct cm_iterator_data *id = (struct cm_iterator_data *)ptr;
-
-	return id->iterator(key, id->ptr);
+	return ATOMIC_LOAD(&s->slots[uid].gen) & 1;
 }
 
 void cm_iterate(int (*iterator)(int uid, void *ptr), void *ptr)
 {
-	struct cm_iterator_data id;
+	ConnSlab s;
+	int i, top;
 
-	id.iterator = iterator;
-	id.ptr = ptr;
+	epoch_enter();
 
-	rcl_read_lock(cm_lock);
-	collection_iterate(ctbl, cm_iterator, &id);
-	rcl_read_unlock(cm_lock);
-}
+	s = ATOMIC_LOAD(&slab);
+	top = ATOMIC_LOAD(&slab_top);
 
-struct broadcast_data {
-	int uid;
-	TransactionOut t;
-};
+	for(i = 0; s != NULL && i < top && i < s->size; i++)
+		if(cm_occupied(s, i) && !iterator(i, ptr))
+			break;
 
-static int broadcast_iterator(CollectionKey uid, void *data, void *ptr)
+	epoch_exit();
+}
+
+void cm_transaction_broadcast(int uid, TransactionOut t)
 {
-	struct broadcast_data *d = (struct broadcast_data *)ptr;
+	Connection c;
+	ConnSlab s;
+	int i, top;
 
-	if(uid == d->uid)
-		return 1;
+	epoch_enter();
 
-	if(((Connection)data)->cstate == CSTATE_NL)
-		return 1;
+	s = ATOMIC_LOAD(&slab);
+	top = ATOMIC_LOAD(&slab_top);
 
-	transaction_write(uid, d->t);
+	/* The same transaction goes to everyone, so its lengths are filled
+	   in once, and only each recipient's task number is stamped.
+	   Nothing here blocks, so a slow recipient doesn't hold up the
+	   others */
+	transaction_seal(t);
 
-	return 1;
-}
+	for(i = 0; s != NULL && i < top && i < s->size; i++) {
+		if(i == uid || !cm_occupied(s, i) || (c = cm_get(i, 0)) == NULL)
+			continue;
 
-void cm_transaction_broadcast(int uid, TransactionOut t)
-{
-	struct broadcast_data d;
+		if(c->cstate != CSTATE_NL)
+			cm_output(i, c, t, cm_taskno(c));
 
-	d.uid = uid;
-	d.t = t;
-	
-	rcl_read_lock(cm_lock);
-	collection_iterate(ctbl, broadcast_iterator, &d);
-	rcl_read_unlock(cm_lock);
+		cm_put(c, 0);
+	}
+
+	epoch_exit();
 
 	transaction_out_destroy(t);
 }
 
-static int cm_userlist_iterator(CollectionKey uid, void *data, void *ptr)
+static void cm_userlist_entry(TransactionOut t, int uid)
 {
-	Connection c = (Connection)data;
-	TransactionOut t = (TransactionOut)ptr;
-	
+	Connection c;
 	uint8_t *ulentry;
 	int16_t v, l;
 
-	rcl_read_lock(c->lock);
+	if((c = cm_get(uid, 0)) == NULL)
+		return;
+
 	if(c->cstate != CSTATE_LI)
 		goto done;
 		
@@ -441,19 +855,26 @@ static int cm_userlist_iterator(CollectionKey uid, void *data, void *ptr)
 	transaction_add_object(t, HL_USERLIST_ENTRY, ulentry, l + 8);
 	xfree(ulentry);
 done:
-	rcl_read_unlock(c->lock);
-
-	return 1;
+	cm_put(c, 0);
 }
 
 TransactionOut cm_build_userlist(TransactionIn t)
 {
 	TransactionOut reply;
-	
-	rcl_read_lock(cm_lock);
-	reply = transaction_reply_create(t, 0, collection_size(ctbl));
-	collection_iterate(ctbl, cm_userlist_iterator, reply);
-	rcl_read_unlock(cm_lock);
+	ConnSlab s;
+	int i, top;
+
+	epoch_enter();
+
+	s = ATOMIC_LOAD(&slab);
+	top = ATOMIC_LOAD(&slab_top);
+	reply = transaction_reply_create(t, 0, ATOMIC_LOAD(&slab_count));
+
+	for(i = 0; s != NULL && i < top && i < s->size; i++)
+		if(cm_occupied(s, i))
+			cm_userlist_entry(reply, i);
+
+	epoch_exit();
 
 	return reply;
 }
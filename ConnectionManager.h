@@ -2,6 +2,8 @@
 #define CONNECTIONMANAGER_H
 
 #include <global.h>
+#include <time.h>
+#include <Multiplexer.h>
 #include <Permissions.h>
 #include <Transaction.h>
 
@@ -22,21 +24,64 @@ typedef enum {
 	CONN_NICKNAME,	/* string */
 } conn_member_t;
 
+/* A copy of what there is to know about a connection, taken all at once */
+struct conn_view {
+	uint32_t ip;
+	cstate_t cstate;
+	uint16_t icon;
+	uint16_t status;
+	time_t last_activity;
+
+	/* Set if the connection has permissions, which are then copied */
+	int has_perms;
+	struct _Permissions perms;
+
+	char nickname[MAX_NICKNAME_LEN + 1];
+};
+
 void cm_init(void);
 void cm_shutdown(void);
 
-void cm_add(int fd, uint32_t ip);
+void cm_add(int fd, uint32_t ip, Multiplexer m);
 void cm_remove(int uid);
 
 int cm_user_count(void);
 
+/* Bytes queued for clients, across every connection */
+int cm_output_bytes(void);
+
 int cm_getval(int uid, conn_member_t mid, void *ptr);
+
+/* Fill in v for a connection, locking it once rather than once a field.
+   Returns -1 if there's no such connection */
+int cm_snapshot(int uid, struct conn_view *v);
+
 int cm_setval(int uid, conn_member_t mid, void *ptr);
 
 cstate_t cm_get_cstate(int uid);
 int cm_set_cstate(int uid, cstate_t s);
-	
-int32_t cm_get_taskno(int uid);
+
+Multiplexer cm_get_multiplexer(int uid);
+
+/* Read whatever has arrived on a connection.  Returns 1 if it has complete
+   transactions buffered or has failed, 0 if it's waiting for more input,
+   or -1 if there's no such connection */
+int cm_input_fill(int uid);
+
+/* Detach the complete transactions buffered for a connection */
+TransactionBuffer cm_input_take(int uid);
+
+/* Watch a connection for input again once its transactions are handled.
+   If reading is paused until its output drains, it's rearmed when it has */
+void cm_input_rearm(int uid);
+
+/* Write a transaction without blocking, queueing whatever the socket won't
+   take.  A connection whose queue has reached the high watermark is dealt
+   with according to the slow_clients policy */
+int cm_transaction_write(int uid, TransactionOut t);
+
+/* Write out what's queued for a connection which has become writable */
+void cm_output_flush(int uid);
 
 Permissions cm_perm_getall(int uid);
 int cm_perm_setall(int uid, Permissions p);
@@ -0,0 +1,173 @@
+/*
+   Coroutine.c: Stackful coroutines
+*/
+
+#include <machdep.h>
+#include <global.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef HAVE_UCONTEXT
+#include <ucontext.h>
+#endif
+
+#include <Coroutine.h>
+#include <xmalloc.h>
+
+/* Most finished coroutines kept for their stacks */
+#define COROUTINE_CACHE	64
+
+#ifndef MAP_ANON
+#define MAP_ANON	MAP_ANONYMOUS
+#endif
+
+struct _Coroutine {
+	void (*func)(void *);
+	void *arg;
+	int done;
+
+	/* The lowest page of the stack is left inaccessible, so an overflow
+	   faults instead of running into something else */
+	void *stack;
+	size_t stack_size;
+
+#ifdef HAVE_UCONTEXT
+	ucontext_t ctx, caller;
+#endif
+
+	struct _Coroutine *next;
+};
+
+static pthread_key_t coroutine_key;
+static pthread_once_t coroutine_once = PTHREAD_ONCE_INIT;
+
+static Coroutine cache = NULL;
+static int cache_count = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void coroutine_once_init(void)
+{
+	pthread_key_create(&coroutine_key, NULL);
+}
+
+Coroutine coroutine_self()
+{
+	pthread_once(&coroutine_once, coroutine_once_init);
+
+	return (Coroutine)pthread_getspecific(coroutine_key);
+}
+
+#ifdef HAVE_UCONTEXT
+static void coroutine_main(void)
+{
+	Coroutine c = coroutine_self();
+
+	c->func(c->arg);
+	c->done = 1;
+
+	/* Returning carries on with c->caller, through uc_link */
+}
+
+/* A coroutine with size bytes set aside for its stack, guard page
+   included, from the cache if there's one there */
+static Coroutine coroutine_alloc(size_t size, size_t page)
+{
+	Coroutine c, *p;
+	void *stack;
+
+	pthread_mutex_lock(&cache_lock);
+
+	for(p = &cache; *p != NULL; p = &(*p)->next)
+		if((*p)->stack_size == size) {
+			c = *p;
+			*p = c->next;
+			cache_count--;
+
+			pthread_mutex_unlock(&cache_lock);
+			return c;
+		}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	if((stack = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0)) == MAP_FAILED)
+		return NULL;
+
+	mprotect(stack, page, PROT_NONE);
+
+	c = NEW(Coroutine);
+	c->stack = stack;
+	c->stack_size = size;
+
+	return c;
+}
+#endif
+
+Coroutine coroutine_create(void (*func)(void *), void *arg, size_t stack_size)
+{
+#ifdef HAVE_UCONTEXT
+	Coroutine c;
+	size_t page;
+
+	pthread_once(&coroutine_once, coroutine_once_init);
+
+	page = sysconf(_SC_PAGESIZE);
+
+	if((c = coroutine_alloc((stack_size + page - 1) / page * page + page, page)) == NULL)
+		return NULL;
+
+	c->func = func;
+	c->arg = arg;
+	c->done = 0;
+	c->next = NULL;
+
+	getcontext(&c->ctx);
+	c->ctx.uc_stack.ss_sp = (char *)c->stack + page;
+	c->ctx.uc_stack.ss_size = c->stack_size - page;
+	c->ctx.uc_link = &c->caller;
+	makecontext(&c->ctx, coroutine_main, 0);
+
+	return c;
+#else
+	return NULL;
+#endif
+}
+
+void coroutine_destroy(Coroutine c)
+{
+	pthread_mutex_lock(&cache_lock);
+
+	if(cache_count < COROUTINE_CACHE) {
+		c->next = cache;
+		cache = c;
+		cache_count++;
+
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	munmap(c->stack, c->stack_size);
+	xfree(c);
+}
+
+int coroutine_resume(Coroutine c)
+{
+#ifdef HAVE_UCONTEXT
+	pthread_setspecific(coroutine_key, c);
+	swapcontext(&c->caller, &c->ctx);
+	pthread_setspecific(coroutine_key, NULL);
+#endif
+
+	return c->done;
+}
+
+void coroutine_yield()
+{
+#ifdef HAVE_UCONTEXT
+	Coroutine c = coroutine_self();
+
+	swapcontext(&c->ctx, &c->caller);
+#endif
+}
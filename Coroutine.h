@@ -0,0 +1,33 @@
+/* Coroutines
+
+   Stackful coroutines on small fixed-size stacks, switched with
+   swapcontext().  A coroutine runs on the thread which resumes it, until
+   it returns or yields.  It should always be resumed by the thread which
+   first resumed it, since the compiler may keep the address of errno and
+   other thread-local state across a yield.
+
+   Only supported where the system has <ucontext.h>.  Elsewhere
+   coroutine_create() always fails. */
+
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <sys/types.h>
+
+typedef struct _Coroutine *Coroutine;
+
+/* A coroutine which will call func(arg) on a stack of stack_size bytes,
+   once it's resumed.  Returns NULL if it couldn't be created */
+Coroutine coroutine_create(void (*func)(void *), void *arg, size_t stack_size);
+void coroutine_destroy(Coroutine c);
+
+/* Run c until it yields or returns.  Returns 1 once it has returned */
+int coroutine_resume(Coroutine c);
+
+/* Called by a coroutine to go back to whoever resumed it */
+void coroutine_yield();
+
+/* The coroutine the calling thread is running, or NULL */
+Coroutine coroutine_self();
+
+#endif
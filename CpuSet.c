@@ -0,0 +1,193 @@
+/*
+   CpuSet.c: Binding threads to configured CPUs
+*/
+
+#include <machdep.h>
+#include <global.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+
+#include <Config.h>
+#include <CpuSet.h>
+#include <log.h>
+#include <xmalloc.h>
+
+/* Highest CPU number accepted, plus one */
+#define CPU_LIMIT	1024
+
+struct _CpuSet {
+	char *name;
+
+	int *cpus;
+	int count;
+};
+
+#ifdef HAVE_SCHED_SETAFFINITY
+/* The CPUs the server was started on, and whether any set has been
+   configured, without which there's never anything to undo */
+static cpu_set_t startup_mask;
+static int configured = 0;
+#endif
+
+static void cpuset_add(CpuSet s, int cpu)
+{
+	s->cpus = (int *)xrealloc(s->cpus, sizeof(int) * (s->count + 1));
+	s->cpus[s->count++] = cpu;
+}
+
+/* Add a CPU number, or a range of them such as 0-3.  Returns -1 if it's
+   malformed */
+static int cpuset_parse(CpuSet s, char *item)
+{
+	char *end;
+	long first, last;
+
+	first = last = strtol(item, &end, 10);
+	if(end == item || first < 0)
+		return -1;
+
+	if(*end == '-') {
+		item = end + 1;
+
+		last = strtol(item, &end, 10);
+		if(end == item || last < first)
+			return -1;
+	}
+
+	while(*end == ' ')
+		end++;
+
+	if(*end != '\0' || last >= CPU_LIMIT)
+		return -1;
+
+	for(; first <= last; first++)
+		cpuset_add(s, (int)first);
+
+	return 0;
+}
+
+CpuSet cpuset_config(char *var)
+{
+	CpuSet s;
+	char *t, *name;
+	int i, ret;
+
+	if((t = config_vlist_value("threads", var, 0)) == NULL)
+		return NULL;
+
+	s = NEW(CpuSet);
+	s->name = t;
+	s->cpus = NULL;
+	s->count = 0;
+
+	ret = cpuset_parse(s, t);
+
+	/* Config splits the list at its commas */
+	for(i = 1; ret == 0 && (t = config_vlist_value("threads", var, i)) != NULL; i++) {
+		ret = cpuset_parse(s, t);
+
+		name = xasprintf("%s,%s", s->name, t);
+		xfree(s->name);
+		xfree(t);
+		s->name = name;
+	}
+
+	if(ret < 0) {
+		log("!!! Warning: threads::%s isn't a valid list of CPUs, ignoring it", var);
+		cpuset_destroy(s);
+
+		return NULL;
+	}
+
+#ifdef HAVE_SCHED_SETAFFINITY
+	if(!configured) {
+		sched_getaffinity(0, sizeof(cpu_set_t), &startup_mask);
+		configured = 1;
+	}
+
+	/* Drop any CPUs we can't run on, rather than fail on every bind */
+	for(i = ret = 0; i < s->count; i++)
+		if(CPU_ISSET(s->cpus[i], &startup_mask))
+			s->cpus[ret++] = s->cpus[i];
+
+	if(ret < s->count) {
+		log("!!! Warning: Some CPUs in threads::%s aren't available, ignoring them", var);
+
+		if((s->count = ret) == 0) {
+			cpuset_destroy(s);
+			return NULL;
+		}
+
+		/* Name what's left */
+		xfree(s->name);
+		s->name = xasprintf("%d", s->cpus[0]);
+
+		for(i = 1; i < s->count; i++) {
+			name = xasprintf("%s,%d", s->name, s->cpus[i]);
+			xfree(s->name);
+			s->name = name;
+		}
+	}
+
+	return s;
+#else
+	log("!!! Warning: Binding threads to CPUs is unsupported, ignoring threads::%s", var);
+	cpuset_destroy(s);
+
+	return NULL;
+#endif
+}
+
+void cpuset_destroy(CpuSet s)
+{
+	if(s->cpus != NULL)
+		xfree(s->cpus);
+
+	xfree(s->name);
+	xfree(s);
+}
+
+char *cpuset_name(CpuSet s)
+{
+	return s->name;
+}
+
+int cpuset_bind(CpuSet s, int index)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t mask;
+	int i, cpu = -1;
+
+	if(!configured)
+		return -1;
+
+	if(s == NULL)
+		mask = startup_mask;
+	else if(index >= 0) {
+		cpu = s->cpus[index % s->count];
+
+		CPU_ZERO(&mask);
+		CPU_SET(cpu, &mask);
+	} else {
+		CPU_ZERO(&mask);
+
+		for(i = 0; i < s->count; i++)
+			CPU_SET(s->cpus[i], &mask);
+	}
+
+	/* Zero means the calling thread */
+	if(sched_setaffinity(0, sizeof(cpu_set_t), &mask) < 0) {
+		log("!!! Warning: Couldn't bind thread to CPUs %s", s == NULL ? "it started on" : s->name);
+		return -1;
+	}
+
+	return cpu;
+#else
+	return -1;
+#endif
+}
@@ -0,0 +1,29 @@
+/* CPU sets
+
+   A list of CPUs from the configuration, such as "0-3,8", which threads
+   may be bound to.  Binding is only supported where the system has
+   sched_setaffinity(), and does nothing elsewhere.
+
+   Threads inherit their creator's binding, so a thread in a role with no
+   CPUs configured calls cpuset_bind() with a NULL set, which puts it back
+   on every CPU the server started with. */
+
+#ifndef CPUSET_H
+#define CPUSET_H
+
+typedef struct _CpuSet *CpuSet;
+
+/* The CPUs listed in threads::var, or NULL if it's unset or invalid.  Must
+   be called before any thread has been bound */
+CpuSet cpuset_config(char *var);
+void cpuset_destroy(CpuSet s);
+
+/* The list as configured */
+char *cpuset_name(CpuSet s);
+
+/* Bind the calling thread to the index'th CPU in s, wrapping around, or to
+   all of them if index is -1.  Returns the CPU bound to, or -1 for several
+   or none.  Failure is logged */
+int cpuset_bind(CpuSet s, int index);
+
+#endif
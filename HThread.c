@@ -1,24 +1,39 @@
 #include <pthread.h>
+#include <limits.h>
 
 #include <HThread.h>
-#include <MQueue.h>
 #include <helper_thread.h>
 #include <xmalloc.h>
 
 struct _HThread {
 	pthread_t tid;
-	MQueue q;
+
+	void *data;
 };
 
-HThread hthread_create()
+HThread hthread_create(void *data, size_t stack_size)
 {
 	HThread t;
+	pthread_attr_t attr;
+	int r;
 	
 	t = NEW(HThread);
-	t->q = mqueue_create();
+	t->data = data;
+
+	pthread_attr_init(&attr);
+
+	if(stack_size > 0) {
+#ifdef PTHREAD_STACK_MIN
+		if(stack_size < PTHREAD_STACK_MIN)
+			stack_size = PTHREAD_STACK_MIN;
+#endif
+		pthread_attr_setstacksize(&attr, stack_size);
+	}
 	
-	if(pthread_create(&t->tid, NULL, helper_thread, t) != 0) {
-		mqueue_destroy(t->q);
+	r = pthread_create(&t->tid, &attr, helper_thread, t);
+	pthread_attr_destroy(&attr);
+
+	if(r != 0) {
 		xfree(t);
 
 		return NULL;
@@ -29,15 +44,13 @@ HThread hthread_create()
 	return t;
 }
 
-void hthread_destroy(HThread t)
+/* Called by the thread itself as it exits */
+void hthread_free(HThread t)
 {
-	mqueue_send(t->q, HT_KILL);
-	mqueue_destroy(t->q);
-
 	xfree(t);
 }
 
-MQueue hthread_queue(HThread t)
+void *hthread_data(HThread t)
 {
-	return t->q;
+	return t->data;
 }
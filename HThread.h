@@ -4,10 +4,11 @@
 typedef struct _HThread *HThread;
 
 #include <global.h>
-#include <MQueue.h>
 
-HThread hthread_create();
-void hthread_destroy(HThread t);
-MQueue hthread_queue(HThread t);
+/* Start a helper thread, which may be given some data of its own, with a
+   stack of stack_size bytes, or the system's default if 0 */
+HThread hthread_create(void *data, size_t stack_size);
+void hthread_free(HThread t);
+void *hthread_data(HThread t);
 
 #endif
@@ -10,7 +10,7 @@ SunOS)
 	ln -s Multiplexer.devpoll.c Multiplexer.c
 	;;
 Linux)
-	ln -s Multiplexer.poll.c Multiplexer.c
+	ln -s Multiplexer.epoll.c Multiplexer.c
 	;;
 FreeBSD)
 	ln -s Multiplexer.kqueue.c Multiplexer.c
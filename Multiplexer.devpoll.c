@@ -7,139 +7,303 @@
 #include <unistd.h>
 #include <stropts.h>
 #include <stdlib.h>
-#include <signal.h>
 #include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
 #include <pthread.h>
 
+#include <ChangeQueue.h>
 #include <Multiplexer.h>
-#include <RCL.h>
+#include <Notifier.h>
+#include <atomic.h>
 #include <machdep.h>
+#include <xmalloc.h>
 
 #ifdef DEBUG
 #include <output.h>
 #endif
 
-static int dp = -1;
-static pthread_t mtid;
-static RCL mlock = NULL;
+#define INITIAL_TABLE_SIZE	64
 
-static void multiplex_handler(int i)
-{
-#ifdef DEBUG
-	debug("*** Multiplex notifier activated");
-#endif
-}
+/* Per-descriptor flags.  /dev/poll has no notion of one-shot events, so
+   one-shot directions are taken out of the set when they're reported and
+   written back when they're rearmed */
+#define WANT_RD		0x01
+#define WANT_WR		0x02
+#define ONESHOT_RD	0x04
+#define ONESHOT_WR	0x08
+#define DISARMED_RD	0x10
+#define DISARMED_WR	0x20
 
-void multiplexer_create()
-{
-	mtid = pthread_self();
+/* Largest batch of events harvested by a single DP_POLL */
+#define MAX_EVENTS		64
 
-	if(dp != -1)
-		close(dp);
+/* The /dev/poll set is only written by the polling thread.  Other threads
+   post their changes to the change queue and wake it up */
+struct _Multiplexer {
+	int dp;
 
-	if(mlock == NULL)
-		mlock = rcl_create();
+	/* Flags, indexed by descriptor */
+	uint8_t *fdtbl;
+	unsigned int fdtbl_size;
 
-	if((dp = open("/dev/poll", O_RDWR)) < 0) {
-		perror("/dev/poll");
-		exit(EXIT_FAILURE);
-	}
+	ChangeQueue changes;
+	Notifier notifier;
 
-#ifdef HAVE_SIGSET
-	sigset(SIGUSR1, multiplex_handler);
-#else
-	signal(SIGUSR1, multiplex_handler);
-#endif
-}
+	/* The thread which polls this multiplexer, once it has started */
+	pthread_t owner;
+	int polling;
+};
 
-void multiplexer_destroy()
+static int multiplexer_owned(Multiplexer m)
 {
-	close(dp);
+	return ATOMIC_LOAD(&m->polling) && pthread_equal(pthread_self(), m->owner);
 }
 
-void multiplexer_add(int fd, mevent_t event)
+static void devpoll_write(Multiplexer m, int fd, short events)
 {
 	struct pollfd pfd;
 
 	pfd.fd = fd;
-	pfd.events = 0;
+	pfd.events = events;
 	pfd.revents = 0;
 
+	write(m->dp, &pfd, sizeof(struct pollfd));
+}
+
+/* Write the armed directions of a descriptor into the set.  Writing a
+   descriptor which is already there adds to its events, so it's removed
+   first */
+static void devpoll_sync(Multiplexer m, int fd)
+{
+	uint8_t f = m->fdtbl[fd];
+	short events = 0;
+
+	if((f & WANT_RD) && !(f & DISARMED_RD))
+		events |= POLLIN;
+
+	if((f & WANT_WR) && !(f & DISARMED_WR))
+		events |= POLLOUT;
+
+	devpoll_write(m, fd, POLLREMOVE);
+
+	if(events)
+		devpoll_write(m, fd, events);
+}
+
+static void devpoll_add(Multiplexer m, int fd, mevent_t event, mmode_t mode)
+{
+	unsigned int size;
+
+	if(fd >= m->fdtbl_size) {
+		for(size = m->fdtbl_size; size <= fd; size *= 2);
+
+		m->fdtbl = (uint8_t *)xrealloc(m->fdtbl, size * sizeof(uint8_t));
+		memset(m->fdtbl + m->fdtbl_size, 0, size - m->fdtbl_size);
+		m->fdtbl_size = size;
+	}
+
 	switch(event) {
 		case MPLX_RD:
-			pfd.events = POLLIN;
+			m->fdtbl[fd] &= ~(ONESHOT_RD | DISARMED_RD);
+			m->fdtbl[fd] |= WANT_RD | ((mode & MPLX_ONESHOT) ? ONESHOT_RD : 0);
 			break;
 		case MPLX_WR:
-			pfd.events = POLLOUT;
+			m->fdtbl[fd] &= ~(ONESHOT_WR | DISARMED_WR);
+			m->fdtbl[fd] |= WANT_WR | ((mode & MPLX_ONESHOT) ? ONESHOT_WR : 0);
 			break;
 	}
-	
-	/* Prevent the polling loop from reacquiring the lock */
-	rcl_write_reserve_lock(mlock);
 
-	/* Interrupt the polling function so we can alter structures */
-	if(!pthread_equal(pthread_self(), mtid))
-		pthread_kill(mtid, SIGUSR1);
+	devpoll_sync(m, fd);
+}
 
-	/* Block until the polling loop has released the lock */
-	rcl_write_complete_lock(mlock);
+static void devpoll_rearm(Multiplexer m, int fd, mevent_t event)
+{
+	uint8_t bit = event == MPLX_RD ? DISARMED_RD : DISARMED_WR;
 
-	write(dp, &pfd, sizeof(struct pollfd));
+	if(fd >= m->fdtbl_size || !(m->fdtbl[fd] & bit))
+		return;
 
-	rcl_write_unlock(mlock);
+	m->fdtbl[fd] &= ~bit;
+	devpoll_sync(m, fd);
 }
 
-void multiplexer_remove(int fd, mevent_t event)
+static void devpoll_remove(Multiplexer m, int fd, mevent_t event)
 {
-	struct pollfd pfd;
+	if(fd >= m->fdtbl_size)
+		return;
 
-	pfd.fd = fd;
-	pfd.events = POLLREMOVE;
-	pfd.revents = 0;
+	if(event == MPLX_RD)
+		m->fdtbl[fd] &= ~(WANT_RD | ONESHOT_RD | DISARMED_RD);
+	else
+		m->fdtbl[fd] &= ~(WANT_WR | ONESHOT_WR | DISARMED_WR);
+
+	devpoll_sync(m, fd);
+}
+
+/* Apply changes posted by other threads, in the order they were made */
+static void multiplexer_apply(Multiplexer m)
+{
+	Change c, t;
+
+	for(c = changequeue_take(m->changes); c != NULL; c = t) {
+		t = c->l;
+
+		switch(c->op) {
+			case MCHANGE_ADD:
+				devpoll_add(m, c->fd, c->event, c->mode);
+				break;
+			case MCHANGE_REARM:
+				devpoll_rearm(m, c->fd, c->event);
+				break;
+			case MCHANGE_REMOVE:
+				devpoll_remove(m, c->fd, c->event);
+				break;
+		}
+
+		xfree(c);
+	}
+}
+
+Multiplexer multiplexer_create()
+{
+	Multiplexer m = NEW(Multiplexer);
+
+	if((m->dp = open("/dev/poll", O_RDWR)) < 0) {
+		perror("/dev/poll");
+		exit(EXIT_FAILURE);
+	}
+
+	m->fdtbl_size = INITIAL_TABLE_SIZE;
+	m->fdtbl = (uint8_t *)xcalloc(m->fdtbl_size, sizeof(uint8_t));
+
+	m->changes = changequeue_create();
+	m->notifier = notifier_create();
+	m->polling = 0;
+
+	devpoll_write(m, notifier_fd(m->notifier), POLLIN);
+
+	return m;
+}
+
+void multiplexer_destroy(Multiplexer m)
+{
+	close(m->dp);
+	xfree(m->fdtbl);
+
+	changequeue_destroy(m->changes);
+	notifier_destroy(m->notifier);
 
-	/* Prevent the polling loop from reacquiring the lock */
-	rcl_write_reserve_lock(mlock);
+	xfree(m);
+}
 
-	/* Interrupt the polling function so we can alter structures */
-	if(!pthread_equal(pthread_self(), mtid))
-		pthread_kill(mtid, SIGUSR1);
+/* /dev/poll is level triggered only, so MPLX_EDGE is ignored */
+void multiplexer_add_mode(Multiplexer m, int fd, mevent_t event, mmode_t mode)
+{
+	if(!multiplexer_owned(m)) {
+		changequeue_push(m->changes, fd, event, mode, MCHANGE_ADD);
+		notifier_signal(m->notifier);
+		return;
+	}
+
+	/* Anything queued earlier has to be applied first to keep ordering */
+	multiplexer_apply(m);
+	devpoll_add(m, fd, event, mode);
+}
 
-	/* Block until the polling loop has released the lock */
-	rcl_write_complete_lock(mlock);
+void multiplexer_add(Multiplexer m, int fd, mevent_t event)
+{
+	multiplexer_add_mode(m, fd, event, MPLX_LEVEL);
+}
 
-	write(dp, &pfd, sizeof(struct pollfd));
+void multiplexer_rearm(Multiplexer m, int fd, mevent_t event)
+{
+	if(!multiplexer_owned(m)) {
+		changequeue_push(m->changes, fd, event, MPLX_LEVEL, MCHANGE_REARM);
+		notifier_signal(m->notifier);
+		return;
+	}
 
-	rcl_write_unlock(mlock);
+	multiplexer_apply(m);
+	devpoll_rearm(m, fd, event);
 }
 
-int multiplexer_poll(int *fd, mevent_t *event)
+void multiplexer_remove(Multiplexer m, int fd, mevent_t event)
+{
+	if(!multiplexer_owned(m)) {
+		changequeue_push(m->changes, fd, event, MPLX_LEVEL, MCHANGE_REMOVE);
+		notifier_signal(m->notifier);
+		return;
+	}
+
+	multiplexer_apply(m);
+	devpoll_remove(m, fd, event);
+}
+
+void multiplexer_wakeup(Multiplexer m)
+{
+	notifier_signal(m->notifier);
+}
+
+int multiplexer_poll_many(Multiplexer m, struct mevent *out, int max, int timeout)
 {
 	struct dvpoll dvp;
-	struct pollfd pfd;
+	struct pollfd pfds[MAX_EVENTS];
+	int i, r, n, fd;
+	uint8_t f;
+
+	if(!m->polling) {
+		m->owner = pthread_self();
+		ATOMIC_STORE(&m->polling, 1);
+	}
 
-	dvp.dp_fds = &pfd;
-	dvp.dp_nfds = 1;
-	dvp.dp_timeout = -1;
+	if(max > MAX_EVENTS)
+		max = MAX_EVENTS;
 
-	rcl_read_lock(mlock);
-	if(ioctl(dp, DP_POLL, &dvp) < 1)  {
-		rcl_read_unlock(mlock);
+	dvp.dp_fds = pfds;
+	dvp.dp_nfds = max;
+	dvp.dp_timeout = timeout;
+
+	multiplexer_apply(m);
+
+	if((r = ioctl(m->dp, DP_POLL, &dvp)) < 0)
 		return -1;
-	}
-	rcl_read_unlock(mlock);
 
-	if(fd != NULL)
-		*fd = pfd.fd;
+	for(i = n = 0; i < r; i++) {
+		fd = pfds[i].fd;
+
+		if(fd == notifier_fd(m->notifier)) {
+			notifier_clear(m->notifier);
+			continue;
+		}
+
+		if(fd >= m->fdtbl_size)
+			continue;
 
-	if(event == NULL)
-		return 0;
+		f = m->fdtbl[fd];
 
-	*event = -1;
+		/* Errors and hangups are reported through whichever events
+		   the descriptor is registered for.  Each direction takes its
+		   own entry in out */
+		if((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) && (f & (WANT_RD | DISARMED_RD)) == WANT_RD && n < max) {
+			out[n].fd = fd;
+			out[n++].event = MPLX_RD;
 
-	if(pfd.revents & POLLIN)
-		*event = MPLX_RD;
-	else if(pfd.revents & POLLOUT)
-		*event = MPLX_WR;
+			if(f & ONESHOT_RD)
+				m->fdtbl[fd] |= DISARMED_RD;
+		}
+
+		if((pfds[i].revents & (POLLOUT | POLLHUP | POLLERR)) && (f & (WANT_WR | DISARMED_WR)) == WANT_WR && n < max) {
+			out[n].fd = fd;
+			out[n++].event = MPLX_WR;
+
+			if(f & ONESHOT_WR)
+				m->fdtbl[fd] |= DISARMED_WR;
+		}
+
+		if(m->fdtbl[fd] != f)
+			devpoll_sync(m, fd);
+	}
 
-	return 0;
+	return n;
 }
@@ -0,0 +1,316 @@
+/* Abstract stateful multiplexer - implemented with epoll */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <Multiplexer.h>
+#include <Notifier.h>
+#include <machdep.h>
+#include <xmalloc.h>
+
+#ifdef DEBUG
+#include <output.h>
+#endif
+
+/* Largest batch of events harvested by a single epoll_wait() */
+#define MAX_EVENTS		64
+#define INITIAL_TABLE_SIZE	64
+
+/* Per-descriptor interest bits */
+#define WANT_RD		0x01
+#define WANT_WR		0x02
+#define WANT_EDGE	0x04
+#define WANT_ONESHOT	0x08
+#define DISARMED_RD	0x10
+#define DISARMED_WR	0x20
+
+struct _Multiplexer {
+	int ep;
+
+	/* epoll_ctl() may be called while another thread is in epoll_wait(),
+	   so changes go straight to the kernel.  The notifier is only used to
+	   wake the polling thread for multiplexer_wakeup() */
+	Notifier notifier;
+
+	/* Interest table, indexed by descriptor.  epoll only allows a single
+	   registration per descriptor, so read and write interest are
+	   combined here */
+	uint8_t *fdtbl;
+	unsigned int fdtbl_size;
+
+	pthread_mutex_t mutex;
+};
+
+Multiplexer multiplexer_create()
+{
+	Multiplexer m = NEW(Multiplexer);
+	struct epoll_event ev;
+
+	if((m->ep = epoll_create(MAX_EVENTS)) < 0) {
+		perror("epoll_create");
+		exit(EXIT_FAILURE);
+	}
+
+	m->notifier = notifier_create();
+
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN;
+	ev.data.fd = notifier_fd(m->notifier);
+	epoll_ctl(m->ep, EPOLL_CTL_ADD, ev.data.fd, &ev);
+
+	m->fdtbl_size = INITIAL_TABLE_SIZE;
+	m->fdtbl = (uint8_t *)xcalloc(m->fdtbl_size, sizeof(uint8_t));
+
+	pthread_mutex_init(&m->mutex, NULL);
+
+	return m;
+}
+
+void multiplexer_destroy(Multiplexer m)
+{
+	close(m->ep);
+	notifier_destroy(m->notifier);
+
+	xfree(m->fdtbl);
+
+	pthread_mutex_destroy(&m->mutex);
+	xfree(m);
+}
+
+static uint8_t event_bit(mevent_t event)
+{
+	switch(event) {
+		case MPLX_RD:
+			return WANT_RD;
+		case MPLX_WR:
+			return WANT_WR;
+	}
+
+	return 0;
+}
+
+static uint8_t disarmed_bit(mevent_t event)
+{
+	switch(event) {
+		case MPLX_RD:
+			return DISARMED_RD;
+		case MPLX_WR:
+			return DISARMED_WR;
+	}
+
+	return 0;
+}
+
+/* Push the interest bits for a descriptor into the kernel.  Must be called
+   with the mutex held */
+static void multiplexer_update(Multiplexer m, int fd, uint8_t old)
+{
+	struct epoll_event ev;
+	uint8_t want = m->fdtbl[fd];
+
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.data.fd = fd;
+
+	if((want & WANT_RD) && !(want & DISARMED_RD))
+		ev.events |= EPOLLIN;
+
+	if((want & WANT_WR) && !(want & DISARMED_WR))
+		ev.events |= EPOLLOUT;
+
+	if(want & WANT_EDGE)
+		ev.events |= EPOLLET;
+
+	/* Both directions share a registration, so the kernel disarms the
+	   descriptor as a whole when either is reported.  Whichever direction
+	   wasn't reported is armed again straight away */
+	if(want & WANT_ONESHOT)
+		ev.events |= EPOLLONESHOT;
+
+	if(!(want & (WANT_RD | WANT_WR))) {
+		m->fdtbl[fd] = 0;
+		epoll_ctl(m->ep, EPOLL_CTL_DEL, fd, &ev);
+		return;
+	}
+
+	/* The descriptor may have been closed and reused behind our back, in
+	   which case the kernel has already forgotten about it */
+	if(old & (WANT_RD | WANT_WR)) {
+		if(epoll_ctl(m->ep, EPOLL_CTL_MOD, fd, &ev) < 0 && errno == ENOENT)
+			epoll_ctl(m->ep, EPOLL_CTL_ADD, fd, &ev);
+	} else {
+		if(epoll_ctl(m->ep, EPOLL_CTL_ADD, fd, &ev) < 0 && errno == EEXIST)
+			epoll_ctl(m->ep, EPOLL_CTL_MOD, fd, &ev);
+	}
+}
+
+void multiplexer_add_mode(Multiplexer m, int fd, mevent_t event, mmode_t mode)
+{
+	uint8_t old;
+	unsigned int size;
+
+	if(fd < 0)
+		return;
+
+	pthread_mutex_lock(&m->mutex);
+
+	/* Grow the interest table until it covers the descriptor */
+	if(fd >= m->fdtbl_size) {
+		for(size = m->fdtbl_size; size <= fd; size *= 2);
+
+		m->fdtbl = (uint8_t *)xrealloc(m->fdtbl, size * sizeof(uint8_t));
+		memset(m->fdtbl + m->fdtbl_size, 0, size - m->fdtbl_size);
+		m->fdtbl_size = size;
+	}
+
+	old = m->fdtbl[fd];
+	m->fdtbl[fd] |= event_bit(event);
+	m->fdtbl[fd] &= ~disarmed_bit(event);
+
+	/* The mode belongs to the registration, so a descriptor which is
+	   already registered for the other direction keeps its mode */
+	if(!(old & (WANT_RD | WANT_WR))) {
+		m->fdtbl[fd] &= ~(WANT_EDGE | WANT_ONESHOT | DISARMED_RD | DISARMED_WR);
+
+		if(mode & MPLX_EDGE)
+			m->fdtbl[fd] |= WANT_EDGE;
+
+		if(mode & MPLX_ONESHOT)
+			m->fdtbl[fd] |= WANT_ONESHOT;
+	}
+
+	multiplexer_update(m, fd, old);
+
+	pthread_mutex_unlock(&m->mutex);
+}
+
+void multiplexer_add(Multiplexer m, int fd, mevent_t event)
+{
+	multiplexer_add_mode(m, fd, event, MPLX_LEVEL);
+}
+
+void multiplexer_rearm(Multiplexer m, int fd, mevent_t event)
+{
+	uint8_t old;
+
+	if(fd < 0)
+		return;
+
+	pthread_mutex_lock(&m->mutex);
+
+	if(fd >= m->fdtbl_size || !(m->fdtbl[fd] & disarmed_bit(event))) {
+		pthread_mutex_unlock(&m->mutex);
+		return;
+	}
+
+	old = m->fdtbl[fd];
+	m->fdtbl[fd] &= ~disarmed_bit(event);
+
+	multiplexer_update(m, fd, old);
+
+	pthread_mutex_unlock(&m->mutex);
+}
+
+void multiplexer_remove(Multiplexer m, int fd, mevent_t event)
+{
+	uint8_t old;
+
+	if(fd < 0)
+		return;
+
+	pthread_mutex_lock(&m->mutex);
+
+	if(fd >= m->fdtbl_size || !(m->fdtbl[fd] & event_bit(event))) {
+		pthread_mutex_unlock(&m->mutex);
+		return;
+	}
+
+	old = m->fdtbl[fd];
+	m->fdtbl[fd] &= ~(event_bit(event) | disarmed_bit(event));
+
+	multiplexer_update(m, fd, old);
+
+	pthread_mutex_unlock(&m->mutex);
+}
+
+void multiplexer_wakeup(Multiplexer m)
+{
+	notifier_signal(m->notifier);
+}
+
+int multiplexer_poll_many(Multiplexer m, struct mevent *out, int max, int timeout)
+{
+	struct epoll_event events[MAX_EVENTS];
+	uint8_t *fdtbl;
+	int i, r, n, rfd;
+	uint32_t rev;
+
+	if(max > MAX_EVENTS)
+		max = MAX_EVENTS;
+
+	/* A descriptor may be ready in both directions, taking two entries
+	   in out.  Anything which didn't fit would be lost, since edge
+	   triggered and one-shot descriptors aren't reported again, so only
+	   ask for as many as are sure to fit */
+	if((r = epoll_wait(m->ep, events, max > 1 ? max / 2 : 1, timeout)) < 0)
+		return -1;
+
+	pthread_mutex_lock(&m->mutex);
+
+	fdtbl = m->fdtbl;
+
+	for(i = n = 0; i < r; i++) {
+		rfd = events[i].data.fd;
+		rev = events[i].events;
+
+		if(rfd == notifier_fd(m->notifier)) {
+			notifier_clear(m->notifier);
+			continue;
+		}
+
+		if(rfd >= m->fdtbl_size)
+			continue;
+
+		/* Errors and hangups are reported through whichever events
+		   the descriptor is registered for, so the reader sees EOF
+		   and the writer sees the error */
+		if(rev & (EPOLLERR | EPOLLHUP))
+			rev |= EPOLLIN | EPOLLOUT;
+
+		/* Each direction takes its own entry in out.  Directions
+		   which were removed or disarmed after the kernel reported
+		   them are skipped */
+		if((rev & EPOLLIN) && (fdtbl[rfd] & (WANT_RD | DISARMED_RD)) == WANT_RD && n < max) {
+			out[n].fd = rfd;
+			out[n++].event = MPLX_RD;
+
+			if(fdtbl[rfd] & WANT_ONESHOT)
+				fdtbl[rfd] |= DISARMED_RD;
+		}
+
+		if((rev & EPOLLOUT) && (fdtbl[rfd] & (WANT_WR | DISARMED_WR)) == WANT_WR && n < max) {
+			out[n].fd = rfd;
+			out[n++].event = MPLX_WR;
+
+			if(fdtbl[rfd] & WANT_ONESHOT)
+				fdtbl[rfd] |= DISARMED_WR;
+		}
+
+		/* The kernel has disarmed the whole descriptor, so arm
+		   whatever nobody is going to see an event for again */
+		if((fdtbl[rfd] & WANT_ONESHOT) &&
+		   (((fdtbl[rfd] & (WANT_RD | DISARMED_RD)) == WANT_RD) ||
+		    ((fdtbl[rfd] & (WANT_WR | DISARMED_WR)) == WANT_WR)))
+			multiplexer_update(m, rfd, fdtbl[rfd]);
+	}
+
+	pthread_mutex_unlock(&m->mutex);
+
+	return n;
+}
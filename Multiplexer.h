@@ -3,16 +3,53 @@
 
 #include <pthread.h>
 
+/* Each multiplexer is polled by a single thread.  Descriptors may be added,
+   rearmed and removed from any thread */
+typedef struct _Multiplexer *Multiplexer;
+
 typedef enum {
 	MPLX_RD,
 	MPLX_WR
 } mevent_t;
 
-void multiplexer_create();
-void multiplexer_destroy();
+/* Triggering modes.  Backends which can't do edge triggering (poll, select
+   and /dev/poll) always behave as level triggered.
+
+   MPLX_ONESHOT may be or'd with either: once an event has been returned by
+   multiplexer_poll_many() the descriptor is disarmed, but stays registered, until
+   multiplexer_rearm() is called for it.
+
+   A descriptor may be registered for MPLX_RD and MPLX_WR at once.  Each is
+   reported, disarmed and rearmed separately, but with epoll the mode is
+   shared, and is set by whichever was registered first */
+typedef enum {
+	MPLX_LEVEL = 0,
+	MPLX_EDGE = 1,
+	MPLX_ONESHOT = 2
+} mmode_t;
+
+/* A ready descriptor, as returned by multiplexer_poll_many() */
+struct mevent {
+	int fd;
+	mevent_t event;
+};
+
+Multiplexer multiplexer_create();
+void multiplexer_destroy(Multiplexer m);
+
+void multiplexer_add(Multiplexer m, int fd, mevent_t event);
+void multiplexer_add_mode(Multiplexer m, int fd, mevent_t event, mmode_t mode);
+void multiplexer_rearm(Multiplexer m, int fd, mevent_t event);
+void multiplexer_remove(Multiplexer m, int fd, mevent_t event);
+
+/* Wait up to timeout milliseconds for events, or forever if timeout is -1,
+   storing up to max of them in out.  Returns the number stored, which is 0
+   if the wait timed out or was interrupted by multiplexer_wakeup(), or -1
+   on error.  max should be at least 2, so a descriptor ready for both
+   reading and writing always fits */
+int multiplexer_poll_many(Multiplexer m, struct mevent *out, int max, int timeout);
 
-void multiplexer_add(int fd, mevent_t event);
-void multiplexer_remove(int fd, mevent_t event);
-int multiplexer_poll(int *fd, mevent_t *event);
+/* Cause a blocked multiplexer_poll_many() to return.  Safe from any thread */
+void multiplexer_wakeup(Multiplexer m);
 	
 #endif
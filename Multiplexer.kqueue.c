@@ -8,26 +8,53 @@
 #include <stdio.h>
 
 #include <Multiplexer.h>
-
-static int kq = -1;
-
-void multiplexer_create()
+#include <Notifier.h>
+#include <xmalloc.h>
+
+/* EV_DISPATCH disables a descriptor after it's reported, leaving it in the
+   queue to be re-enabled.  Where it isn't available EV_ONESHOT deletes it
+   instead, and rearming adds it back */
+#ifndef EV_DISPATCH
+#define EV_DISPATCH	EV_ONESHOT
+#define NO_EV_DISPATCH	1
+#endif
+
+/* Largest batch of events harvested by a single kevent() */
+#define MAX_EVENTS	64
+
+struct _Multiplexer {
+	int kq;
+
+	/* kevent() may be called while another thread is waiting on the
+	   queue, so changes go straight to the kernel.  The notifier is only
+	   used to wake the polling thread for multiplexer_wakeup() */
+	Notifier notifier;
+};
+
+Multiplexer multiplexer_create()
 {
-	if(kq != -1)
-		close(kq);
+	Multiplexer m = NEW(Multiplexer);
 
-	if((kq = kqueue()) < 0) {
+	if((m->kq = kqueue()) < 0) {
 		perror("kqueue");
 		exit(EXIT_FAILURE);
 	}
+
+	m->notifier = notifier_create();
+	multiplexer_add(m, notifier_fd(m->notifier), MPLX_RD);
+
+	return m;
 }
 
-void multiplexer_destroy()
+void multiplexer_destroy(Multiplexer m)
 {
-	close(kq);
+	close(m->kq);
+	notifier_destroy(m->notifier);
+
+	xfree(m);
 }
 
-void multiplexer_add(int fd, mevent_t event)
+void multiplexer_add_mode(Multiplexer m, int fd, mevent_t event, mmode_t mode)
 {
 	struct kevent kev;
 
@@ -41,14 +68,48 @@ void multiplexer_add(int fd, mevent_t event)
 	}
 	
 	kev.ident = fd;
-	kev.flags = EV_ADD | EV_ENABLE | EV_CLEAR;
+	kev.flags = EV_ADD | EV_ENABLE;
 	kev.fflags = 0;
 
-	kevent(kq, &kev, 1, NULL, 0, NULL);
+	if(mode & MPLX_EDGE)
+		kev.flags |= EV_CLEAR;
 
+	if(mode & MPLX_ONESHOT)
+		kev.flags |= EV_DISPATCH;
+
+	kevent(m->kq, &kev, 1, NULL, 0, NULL);
+}
+
+void multiplexer_add(Multiplexer m, int fd, mevent_t event)
+{
+	multiplexer_add_mode(m, fd, event, MPLX_LEVEL);
 }
 
-void multiplexer_remove(int fd, mevent_t event)
+void multiplexer_rearm(Multiplexer m, int fd, mevent_t event)
+{
+	struct kevent kev;
+
+	switch(event) {
+		case MPLX_RD:
+			kev.filter = EVFILT_READ;
+			break;
+		case MPLX_WR:
+			kev.filter = EVFILT_WRITE;
+			break;
+	}
+
+	kev.ident = fd;
+#ifdef NO_EV_DISPATCH
+	kev.flags = EV_ADD | EV_ENABLE | EV_ONESHOT;
+#else
+	kev.flags = EV_ENABLE;
+#endif
+	kev.fflags = 0;
+
+	kevent(m->kq, &kev, 1, NULL, 0, NULL);
+}
+
+void multiplexer_remove(Multiplexer m, int fd, mevent_t event)
 {
 	struct kevent kev;
 
@@ -65,29 +126,47 @@ void multiplexer_remove(int fd, mevent_t event)
 	kev.flags = EV_DELETE;
 	kev.fflags = 0;
 
-	kevent(kq, &kev, 1, NULL, 0, NULL);
+	kevent(m->kq, &kev, 1, NULL, 0, NULL);
 }
 
-int multiplexer_poll(int *fd, mevent_t *event)
+void multiplexer_wakeup(Multiplexer m)
 {
-	int evtype = -1;
-	struct kevent kev;
+	notifier_signal(m->notifier);
+}
 
-	if(kevent(kq, NULL, 0, &kev, 1, NULL) <= 0)
-		return -1;
+int multiplexer_poll_many(Multiplexer m, struct mevent *out, int max, int timeout)
+{
+	struct kevent kevs[MAX_EVENTS];
+	struct timespec ts;
+	int i, r, n;
+
+	if(max > MAX_EVENTS)
+		max = MAX_EVENTS;
 
-	if(kev.flags & EV_ERROR) 
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000;
+
+	if((r = kevent(m->kq, NULL, 0, kevs, max, timeout < 0 ? NULL : &ts)) < 0)
 		return -1;
-	else if(kev.filter == EVFILT_READ) 
-		evtype = MPLX_RD;
-	else if(kev.filter == EVFILT_WRITE)
-		evtype = MPLX_WR;
 
-	if(fd != NULL)
-		*fd = kev.ident;
+	for(i = n = 0; i < r; i++) {
+		if(kevs[i].flags & EV_ERROR)
+			continue;
+
+		if((int)kevs[i].ident == notifier_fd(m->notifier)) {
+			notifier_clear(m->notifier);
+			continue;
+		}
 
-	if(event != NULL)
-		*event = evtype;
+		if(kevs[i].filter == EVFILT_READ)
+			out[n].event = MPLX_RD;
+		else if(kevs[i].filter == EVFILT_WRITE)
+			out[n].event = MPLX_WR;
+		else
+			continue;
+
+		out[n++].fd = kevs[i].ident;
+	}
 
-	return 0;
+	return n;
 }
@@ -1,187 +1,257 @@
 /* Abstract stateful multiplexer - implemented with poll() */
 
 #include <sys/types.h>
+#include <inttypes.h>
 #include <poll.h>
 #include <string.h>
-#include <signal.h>
 #include <pthread.h>
 
+#include <ChangeQueue.h>
 #include <Multiplexer.h>
-#include <RCL.h>
+#include <Notifier.h>
+#include <atomic.h>
 #include <output.h>
 #include <machdep.h>
 #include <xmalloc.h>
 
 #define INITIAL_TABLE_SIZE	64
 
-static RCL mlock = NULL;
-static struct pollfd *fdtbl = NULL;
-static unsigned int fdtbl_count, fdtbl_size, pcomplete, retfds, curfd;
-static pthread_t mtid;
+/* Per-entry flags */
+#define FD_ONESHOT		0x01
 
-static void multiplex_handler(int i)
+/* The descriptor table is only ever touched by the polling thread.  Other
+   threads post their changes to the change queue and wake it up */
+struct _Multiplexer {
+	struct pollfd *fdtbl;
+	uint8_t *fdflags;
+	unsigned int fdtbl_count, fdtbl_size;
+
+	ChangeQueue changes;
+	Notifier notifier;
+
+	/* The thread which polls this multiplexer, once it has started */
+	pthread_t owner;
+	int polling;
+};
+
+static int multiplexer_owned(Multiplexer m)
 {
-#ifdef DEBUG
-	debug("*** Multiplex notifier activated");
-#endif
+	return ATOMIC_LOAD(&m->polling) && pthread_equal(pthread_self(), m->owner);
 }
 
-void multiplexer_create()
+static short poll_events(mevent_t event)
 {
-	mtid = pthread_self();
+	switch(event) {
+		case MPLX_RD:
+			return POLLIN;
+		case MPLX_WR:
+			return POLLOUT;
+	}
+
+	return 0;
+}
 
-	if(mlock == NULL)
-		mlock = rcl_create();
+/* A descriptor has an entry for each event it's registered for.  Disarmed
+   entries hold the complement of their descriptor, which poll() ignores
+   since it's negative */
+static int poll_find(Multiplexer m, int fd, mevent_t event)
+{
+	short pev = poll_events(event);
+	int i;
 
-	if(fdtbl == NULL) {
-		fdtbl_count = 0;
-		pcomplete = 0;
-		fdtbl_size = INITIAL_TABLE_SIZE;
-		fdtbl = (struct pollfd *)xmalloc(fdtbl_size * sizeof(struct pollfd));
-	}
+	for(i = 0; i < m->fdtbl_count; i++)
+		if((m->fdtbl[i].fd == fd || m->fdtbl[i].fd == ~fd) && m->fdtbl[i].events == pev)
+			break;
 
-#ifdef HAVE_SIGSET
-	sigset(SIGUSR1, multiplex_handler);
-#else
-	signal(SIGUSR1, multiplex_handler);
-#endif
+	return i < m->fdtbl_count ? i : -1;
 }
 
-void multiplexer_destroy()
+static void poll_add(Multiplexer m, int fd, mevent_t event, mmode_t mode)
 {
-	xfree(fdtbl);
-	fdtbl = NULL;
+	/* If the table is full, double its size */
+	if(m->fdtbl_count == m->fdtbl_size) {
+		m->fdtbl_size *= 2;
+		m->fdtbl = (struct pollfd *)xrealloc(m->fdtbl, m->fdtbl_size * sizeof(struct pollfd));
+		m->fdflags = (uint8_t *)xrealloc(m->fdflags, m->fdtbl_size * sizeof(uint8_t));
+	}
+
+	m->fdtbl[m->fdtbl_count].fd = fd;
+	m->fdtbl[m->fdtbl_count].events = poll_events(event);
+	m->fdtbl[m->fdtbl_count].revents = 0;
+
+	m->fdflags[m->fdtbl_count] = (mode & MPLX_ONESHOT) ? FD_ONESHOT : 0;
+
+	m->fdtbl_count++;
 }
 
-void multiplexer_add(int fd, mevent_t event)
+static void poll_rearm(Multiplexer m, int fd, mevent_t event)
 {
-	short pev = 0; 
+	int i;
 
-	/* Prevent the polling loop from reacquiring the lock */
-	rcl_write_reserve_lock(mlock);
+	if((i = poll_find(m, fd, event)) < 0)
+		return;
 
-	/* Interrupt the polling function so we can alter structures */
-	if(!pthread_equal(pthread_self(), mtid))
-		pthread_kill(mtid, SIGUSR1);
+	m->fdtbl[i].fd = fd;
+}
 
-	/* Block until the polling loop has released the lock */
-	rcl_write_complete_lock(mlock);
+static void poll_remove(Multiplexer m, int fd, mevent_t event)
+{
+	int i;
 
-	/* If the table is full, double its size */
-	if(fdtbl_count == fdtbl_size) {
-		fdtbl_size *= 2;
-		fdtbl = (struct pollfd *)xrealloc(fdtbl, fdtbl_size * sizeof(struct pollfd));
+	if((i = poll_find(m, fd, event)) < 0)
+		return;
+
+	if(i != m->fdtbl_count - 1) {
+		memmove(m->fdtbl + i, m->fdtbl + i + 1, (m->fdtbl_count - i - 1) * sizeof(struct pollfd));
+		memmove(m->fdflags + i, m->fdflags + i + 1, (m->fdtbl_count - i - 1) * sizeof(uint8_t));
 	}
 
-	fdtbl[fdtbl_count].fd = fd;
+	m->fdtbl_count--;
 
-	switch(event) {
-		case MPLX_RD:
-			pev = POLLIN;
-			break;
-		case MPLX_WR:
-			pev = POLLOUT;
-			break;
+	/* If table is over 4 times as large as its contents, half its size */
+	if(m->fdtbl_size / 4 > m->fdtbl_count && m->fdtbl_size > INITIAL_TABLE_SIZE) {
+		m->fdtbl_size /= 2;
+		m->fdtbl = (struct pollfd *)xrealloc(m->fdtbl, m->fdtbl_size * sizeof(struct pollfd));
+		m->fdflags = (uint8_t *)xrealloc(m->fdflags, m->fdtbl_size * sizeof(uint8_t));
 	}
+}
 
-	fdtbl[fdtbl_count].events = pev;
-	fdtbl[fdtbl_count].revents = 0;
-
-	fdtbl_count++;
+/* Apply changes posted by other threads, in the order they were made */
+static void multiplexer_apply(Multiplexer m)
+{
+	Change c, t;
+
+	for(c = changequeue_take(m->changes); c != NULL; c = t) {
+		t = c->l;
+
+		switch(c->op) {
+			case MCHANGE_ADD:
+				poll_add(m, c->fd, c->event, c->mode);
+				break;
+			case MCHANGE_REARM:
+				poll_rearm(m, c->fd, c->event);
+				break;
+			case MCHANGE_REMOVE:
+				poll_remove(m, c->fd, c->event);
+				break;
+		}
 
-	rcl_write_unlock(mlock);
+		xfree(c);
+	}
 }
 
-void multiplexer_remove(int fd, mevent_t event)
+Multiplexer multiplexer_create()
 {
-	int i;
+	Multiplexer m = NEW(Multiplexer);
+
+	m->fdtbl_count = 0;
+	m->fdtbl_size = INITIAL_TABLE_SIZE;
+	m->fdtbl = (struct pollfd *)xmalloc(m->fdtbl_size * sizeof(struct pollfd));
+	m->fdflags = (uint8_t *)xmalloc(m->fdtbl_size * sizeof(uint8_t));
+
+	m->changes = changequeue_create();
+	m->notifier = notifier_create();
+	m->polling = 0;
 
-	/* Prevent the polling loop from reacquiring the lock */
-	rcl_write_reserve_lock(mlock);
+	poll_add(m, notifier_fd(m->notifier), MPLX_RD, MPLX_LEVEL);
 
-	/* Interrupt the polling function so we can alter structures */
-	if(!pthread_equal(pthread_self(), mtid))
-		pthread_kill(mtid, SIGUSR1);
+	return m;
+}
 
-	/* Block until the polling loop has released the lock */
-	rcl_write_complete_lock(mlock);
+void multiplexer_destroy(Multiplexer m)
+{
+	xfree(m->fdtbl);
+	xfree(m->fdflags);
 
+	changequeue_destroy(m->changes);
+	notifier_destroy(m->notifier);
 
-	for(i = 0; i < fdtbl_count && fdtbl[i].fd != fd; i++);
+	xfree(m);
+}
 
-	if(i == fdtbl_count) {
-		rcl_write_unlock(mlock);
+/* poll() is level triggered only, so MPLX_EDGE is ignored */
+void multiplexer_add_mode(Multiplexer m, int fd, mevent_t event, mmode_t mode)
+{
+	if(!multiplexer_owned(m)) {
+		changequeue_push(m->changes, fd, event, mode, MCHANGE_ADD);
+		notifier_signal(m->notifier);
 		return;
 	}
 
-	if(pcomplete && fdtbl[i].revents != 0)
-		retfds--;
+	/* Anything queued earlier has to be applied first to keep ordering */
+	multiplexer_apply(m);
+	poll_add(m, fd, event, mode);
+}
 
-	if(i != fdtbl_count - 1) 
-		memmove(fdtbl + i, fdtbl + i + 1, (fdtbl_count - i - 1) * sizeof(struct pollfd));
+void multiplexer_add(Multiplexer m, int fd, mevent_t event)
+{
+	multiplexer_add_mode(m, fd, event, MPLX_LEVEL);
+}
 
-	fdtbl_count--;
+void multiplexer_rearm(Multiplexer m, int fd, mevent_t event)
+{
+	if(!multiplexer_owned(m)) {
+		changequeue_push(m->changes, fd, event, MPLX_LEVEL, MCHANGE_REARM);
+		notifier_signal(m->notifier);
+		return;
+	}
 
-	if(pcomplete && curfd > i)
-		curfd--;
+	multiplexer_apply(m);
+	poll_rearm(m, fd, event);
+}
 
-	/* If table is over 4 times as large as its contents, half its size */
-	if(fdtbl_size / 4 > fdtbl_count && fdtbl_size > INITIAL_TABLE_SIZE) {
-		fdtbl_size /= 2;
-		fdtbl = (struct pollfd *)xrealloc(fdtbl, fdtbl_size * sizeof(struct pollfd));
+void multiplexer_remove(Multiplexer m, int fd, mevent_t event)
+{
+	if(!multiplexer_owned(m)) {
+		changequeue_push(m->changes, fd, event, MPLX_LEVEL, MCHANGE_REMOVE);
+		notifier_signal(m->notifier);
+		return;
 	}
 
-	rcl_write_unlock(mlock);
+	multiplexer_apply(m);
+	poll_remove(m, fd, event);
 }
 
-int multiplexer_poll(int *fd, mevent_t *event)
+void multiplexer_wakeup(Multiplexer m)
 {
-	rcl_read_lock(mlock);
+	notifier_signal(m->notifier);
+}
 
-	if(!pcomplete) {
-		if((retfds = poll(fdtbl, fdtbl_count, -1)) < 0) {
-			rcl_read_unlock(mlock);
-			return -1;
-		}
+int multiplexer_poll_many(Multiplexer m, struct mevent *out, int max, int timeout)
+{
+	int i, r, n;
 
-		pcomplete = 1;
-		curfd = 0;
+	if(!m->polling) {
+		m->owner = pthread_self();
+		ATOMIC_STORE(&m->polling, 1);
 	}
 
-	while(curfd < fdtbl_count && retfds > 0) {
-		if(fdtbl[curfd].revents == 0) {
-			curfd++;
-			continue;
-		}
+	multiplexer_apply(m);
 
-		if(fd != NULL)
-			*fd = fdtbl[curfd].fd;
+	if((r = poll(m->fdtbl, m->fdtbl_count, timeout)) < 0)
+		return -1;
 
-		if(event == NULL) {
-			curfd++;
-			if(--retfds == 0)
-				pcomplete = 0;
+	for(i = n = 0; i < m->fdtbl_count && r > 0 && n < max; i++) {
+		if(m->fdtbl[i].revents == 0)
+			continue;
 
-			rcl_read_unlock(mlock);
-			return 0;
+		r--;
+
+		if(m->fdtbl[i].fd == notifier_fd(m->notifier)) {
+			notifier_clear(m->notifier);
+			continue;
 		}
 
-		*event = -1;
-		if(fdtbl[curfd].revents & POLLIN)
-			*event = MPLX_RD;
-		else if(fdtbl[curfd].revents & POLLOUT)
-			*event = MPLX_WR;
+		/* Errors and hangups are reported as whichever event the
+		   entry is for */
+		out[n].fd = m->fdtbl[i].fd;
+		out[n].event = (m->fdtbl[i].events & POLLIN) ? MPLX_RD : MPLX_WR;
 
-		curfd++;
-		if(--retfds == 0)
-			pcomplete = 0;
+		if(m->fdflags[i] & FD_ONESHOT)
+			m->fdtbl[i].fd = ~m->fdtbl[i].fd;
 
-		rcl_read_unlock(mlock);
-		return 0;
+		n++;
 	}
 
-	pcomplete = 0;
-	rcl_read_unlock(mlock);
-
-	return -1;
+	return n;
 }
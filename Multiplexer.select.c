@@ -6,93 +6,54 @@
 #include <inttypes.h>
 #include <string.h>
 #include <pthread.h>
-#include <signal.h>
 
+#include <ChangeQueue.h>
 #include <Multiplexer.h>
-#include <RCL.h>
+#include <Notifier.h>
+#include <atomic.h>
 #include <machdep.h>
 #include <output.h>
 #include <xmalloc.h>
 
+/* Per-descriptor flags */
+#define FD_ONESHOT		0x01
+#define FD_DISARMED		0x02
+
 typedef struct _DescNode {
 	int fd;
 	mevent_t event;
+	uint8_t flags;
 
 	struct _DescNode *l;
 } *DescNode;
 
-typedef struct _Multiplexer {
+/* The descriptor list is only ever touched by the polling thread.  Other
+   threads post their changes to the change queue and wake it up */
+struct _Multiplexer {
 	int maxfd;
-	uint32_t pcomplete : 1, retfds : 31;
 
-	DescNode head, cur, tail;
-	RCL lock;
+	DescNode head, tail;
+
+	ChangeQueue changes;
+	Notifier notifier;
 
 	fd_set rfds;
 	fd_set wfds;
-} *Multiplexer;
-
-static Multiplexer m = NULL;
-static pthread_t mtid;
-
-static void multiplex_handler(int i)
-{
-#ifdef DEBUG
-	debug("*** Multiplex notifier activated");
-#endif
-}
-
-void multiplexer_create()
-{
-	mtid = pthread_self();
-
-	if(m != NULL)
-		multiplexer_destroy();
-
-	m = NEW(Multiplexer);
-
-	m->pcomplete = 0;
-	m->maxfd = 0;
 
-	m->head = m->cur = m->tail = NULL;
+	/* The thread which polls this multiplexer, once it has started */
+	pthread_t owner;
+	int polling;
+};
 
-	m->lock = rcl_create();
-#ifdef HAVE_SIGSET
-	sigset(SIGUSR1, multiplex_handler);
-#else
-	signal(SIGUSR1, multiplex_handler);
-#endif
-}
-
-void multiplexer_destroy()
+static int multiplexer_owned(Multiplexer m)
 {
-	DescNode tmp;
-
-	while(m->head != NULL) {
-		tmp = m->head;
-		m->head = tmp->l;
-
-		xfree(tmp);
-	}
-
-	rcl_destroy(m->lock);
-	xfree(m);
+	return ATOMIC_LOAD(&m->polling) && pthread_equal(pthread_self(), m->owner);
 }
 
-void multiplexer_add(int fd, mevent_t event)
+static void select_add(Multiplexer m, int fd, mevent_t event, mmode_t mode)
 {
-	/* Prevent the polling loop from reacquiring the lock */
-	rcl_write_reserve_lock(m->lock);
-
-	/* Interrupt the polling function so we can alter structures */
-	if(!pthread_equal(pthread_self(), mtid))
-		pthread_kill(mtid, SIGUSR1);
-
-	/* Block until the polling loop has released the lock */
-	rcl_write_complete_lock(m->lock);
-
 	if(m->head == NULL) 
-		m->cur = m->head = m->tail = NEW(DescNode);
+		m->head = m->tail = NEW(DescNode);
 	else {
 		m->tail->l = NEW(DescNode);
 		m->tail = m->tail->l;
@@ -100,48 +61,40 @@ void multiplexer_add(int fd, mevent_t event)
 
 	m->tail->fd = fd;
 	m->tail->event = event;
+	m->tail->flags = (mode & MPLX_ONESHOT) ? FD_ONESHOT : 0;
 	m->tail->l = NULL;
 
 	if(fd > m->maxfd && m->maxfd != -1)
 		m->maxfd = fd;
-
-	rcl_write_unlock(m->lock);
 }
 
-void multiplexer_remove(int fd, mevent_t event)
+static void select_rearm(Multiplexer m, int fd, mevent_t event)
 {
-	DescNode c, t;
-
-	/* Prevent the polling loop from reacquiring the lock */
-	rcl_write_reserve_lock(m->lock);
+	DescNode c;
 
-	/* Interrupt the polling function so we can alter structures */
-	if(!pthread_equal(pthread_self(), mtid))
-		pthread_kill(mtid, SIGUSR1);
-
-	/* Block until the polling loop has released the lock */
-	rcl_write_complete_lock(m->lock);
+	for(c = m->head; c != NULL && (c->fd != fd || c->event != event); c = c->l);
 
+	if(c != NULL)
+		c->flags &= ~FD_DISARMED;
+}
 
-	if(!pthread_equal(pthread_self(), mtid))
-		pthread_kill(mtid, SIGUSR1);
+static void select_remove(Multiplexer m, int fd, mevent_t event)
+{
+	DescNode c, t;
 
 	if(m->head == NULL)
-		goto done;
+		return;
 
-	if(m->head->fd == fd) {
+	if(m->head->fd == fd && m->head->event == event) {
 		t = m->head;
 		m->head = m->head->l;
 
 		xfree(t);
 	} else {
-		for(c = m->head; c->l != NULL && c->l->fd != fd; c = c->l);
+		for(c = m->head; c->l != NULL && (c->l->fd != fd || c->l->event != event); c = c->l);
 
 		if(c->l == NULL) 
-			goto done;
-
-		if(c->l == m->cur)
-			m->cur = m->cur->l;
+			return;
 
 		if(c->l == m->tail)
 			m->tail = c;
@@ -154,99 +107,182 @@ void multiplexer_remove(int fd, mevent_t event)
 
 	if(fd == m->maxfd)
 		m->maxfd = -1;
-
-done:
-	rcl_write_unlock(m->lock);
 }
 
-int multiplexer_poll(int *fd, mevent_t *event)
+/* Apply changes posted by other threads, in the order they were made */
+static void multiplexer_apply(Multiplexer m)
 {
-	int r, rfd, maxfd;
-	int tfd;
-	mevent_t revent;
-
-	rcl_read_lock(m->lock);
-
-	if(m->pcomplete == 0) {
-		if(m->maxfd == 0)
-			return -1;
-
-		FD_ZERO(&m->rfds);
-		FD_ZERO(&m->wfds);
-
-		if(m->maxfd == -1) {
-			for(m->cur = m->head; m->cur != NULL; m->cur = m->cur->l) {
-				tfd = m->cur->fd;
-
-				switch(m->cur->event) {
-					case MPLX_RD:
-						FD_SET(tfd, &(m->rfds));
-						break;
-					case MPLX_WR:
-						FD_SET(tfd, &(m->wfds));
-						break;
-				}
-
-				if(tfd > m->maxfd)
-					m->maxfd = tfd;
-			}
-		} else { 
-			for(m->cur = m->head; m->cur != NULL; m->cur = m->cur->l) {
-				tfd = m->cur->fd;
-
-				switch(m->cur->event) {
-					case MPLX_RD:
-						FD_SET(tfd, &m->rfds);
-						break;
-					case MPLX_WR:
-						FD_SET(tfd, &m->wfds);
-						break;
-				}
-			}
-		}
+	Change c, t;
+
+	for(c = changequeue_take(m->changes); c != NULL; c = t) {
+		t = c->l;
 
-		maxfd = m->maxfd;
-		if((r = select(maxfd + 1, &m->rfds, &m->wfds, NULL, NULL)) < 0) {
-			rcl_read_unlock(m->lock);
-			return -1;
+		switch(c->op) {
+			case MCHANGE_ADD:
+				select_add(m, c->fd, c->event, c->mode);
+				break;
+			case MCHANGE_REARM:
+				select_rearm(m, c->fd, c->event);
+				break;
+			case MCHANGE_REMOVE:
+				select_remove(m, c->fd, c->event);
+				break;
 		}
 
-		m->retfds = r;
-		m->pcomplete = 1;
+		xfree(c);
+	}
+}
+
+Multiplexer multiplexer_create()
+{
+	Multiplexer m = NEW(Multiplexer);
+
+	m->maxfd = 0;
+
+	m->head = m->tail = NULL;
+
+	m->changes = changequeue_create();
+	m->notifier = notifier_create();
+	m->polling = 0;
 
-		m->cur = m->head;
+	select_add(m, notifier_fd(m->notifier), MPLX_RD, MPLX_LEVEL);
+
+	return m;
+}
+
+void multiplexer_destroy(Multiplexer m)
+{
+	DescNode tmp;
+
+	while(m->head != NULL) {
+		tmp = m->head;
+		m->head = tmp->l;
+
+		xfree(tmp);
+	}
+
+	changequeue_destroy(m->changes);
+	notifier_destroy(m->notifier);
+	xfree(m);
+}
+
+/* select() is level triggered only, so MPLX_EDGE is ignored */
+void multiplexer_add_mode(Multiplexer m, int fd, mevent_t event, mmode_t mode)
+{
+	if(!multiplexer_owned(m)) {
+		changequeue_push(m->changes, fd, event, mode, MCHANGE_ADD);
+		notifier_signal(m->notifier);
+		return;
+	}
+
+	/* Anything queued earlier has to be applied first to keep ordering */
+	multiplexer_apply(m);
+	select_add(m, fd, event, mode);
+}
+
+void multiplexer_add(Multiplexer m, int fd, mevent_t event)
+{
+	multiplexer_add_mode(m, fd, event, MPLX_LEVEL);
+}
+
+void multiplexer_rearm(Multiplexer m, int fd, mevent_t event)
+{
+	if(!multiplexer_owned(m)) {
+		changequeue_push(m->changes, fd, event, MPLX_LEVEL, MCHANGE_REARM);
+		notifier_signal(m->notifier);
+		return;
 	}
 
-	while(m->cur != NULL && m->retfds > 0) {
+	multiplexer_apply(m);
+	select_rearm(m, fd, event);
+}
+
+void multiplexer_remove(Multiplexer m, int fd, mevent_t event)
+{
+	if(!multiplexer_owned(m)) {
+		changequeue_push(m->changes, fd, event, MPLX_LEVEL, MCHANGE_REMOVE);
+		notifier_signal(m->notifier);
+		return;
+	}
 
-		rfd = m->cur->fd;
+	multiplexer_apply(m);
+	select_remove(m, fd, event);
+}
 
-		revent = -1;
-		
-		if(FD_ISSET(rfd, &m->rfds))
-			revent = MPLX_RD;
-		else if(FD_ISSET(rfd, &m->wfds))
-			revent = MPLX_WR;
+void multiplexer_wakeup(Multiplexer m)
+{
+	notifier_signal(m->notifier);
+}
 
-		m->cur = m->cur->l;
+int multiplexer_poll_many(Multiplexer m, struct mevent *out, int max, int timeout)
+{
+	int r, n, tfd;
+	DescNode c;
+	struct timeval tv;
 
-		if(revent != -1) {
-			if(--m->retfds < 1)
-				m->pcomplete = 0;
+	if(!m->polling) {
+		m->owner = pthread_self();
+		ATOMIC_STORE(&m->polling, 1);
+	}
 
-			if(fd != NULL)
-				*fd = rfd;
+	multiplexer_apply(m);
 
-			if(event != NULL)
-				*event = revent;
+	FD_ZERO(&m->rfds);
+	FD_ZERO(&m->wfds);
 
-			rcl_read_unlock(m->lock);
-			return 0;
+	if(m->maxfd == -1) {
+		for(c = m->head; c != NULL; c = c->l)
+			if(c->fd > m->maxfd)
+				m->maxfd = c->fd;
+	}
+
+	for(c = m->head; c != NULL; c = c->l) {
+		if(c->flags & FD_DISARMED)
+			continue;
+
+		switch(c->event) {
+			case MPLX_RD:
+				FD_SET(c->fd, &m->rfds);
+				break;
+			case MPLX_WR:
+				FD_SET(c->fd, &m->wfds);
+				break;
 		}
 	}
 
-	m->pcomplete = 0;
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+
+	if((r = select(m->maxfd + 1, &m->rfds, &m->wfds, NULL, timeout < 0 ? NULL : &tv)) < 0)
+		return -1;
+
+	for(c = m->head, n = 0; c != NULL && r > 0 && n < max; c = c->l) {
+		tfd = c->fd;
+
+		/* A descriptor registered for both events has a node for
+		   each */
+		if(c->flags & FD_DISARMED)
+			continue;
+
+		if(c->event == MPLX_RD && FD_ISSET(tfd, &m->rfds))
+			out[n].event = MPLX_RD;
+		else if(c->event == MPLX_WR && FD_ISSET(tfd, &m->wfds))
+			out[n].event = MPLX_WR;
+		else
+			continue;
+
+		r--;
+
+		if(tfd == notifier_fd(m->notifier)) {
+			notifier_clear(m->notifier);
+			continue;
+		}
+
+		if(c->flags & FD_ONESHOT)
+			c->flags |= FD_DISARMED;
+
+		out[n++].fd = tfd;
+	}
 
-	rcl_read_unlock(m->lock);
-	return -1;
+	return n;
 }
@@ -0,0 +1,109 @@
+/*
+   Notifier.c: Cross-thread wakeups through an eventfd or a self-pipe
+*/
+
+#include <global.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <Notifier.h>
+#include <atomic.h>
+#include <machdep.h>
+#include <xmalloc.h>
+
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+struct _Notifier {
+	/* With an eventfd both ends are the same descriptor */
+	int rfd, wfd;
+
+	/* Set while a wakeup is outstanding, so we only write once */
+	int pending;
+};
+
+Notifier notifier_create(void)
+{
+	Notifier n = NEW(Notifier);
+#ifndef HAVE_EVENTFD
+	int fds[2];
+#endif
+
+	n->pending = 0;
+
+#ifdef HAVE_EVENTFD
+	if((n->rfd = n->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		perror("eventfd");
+		exit(EXIT_FAILURE);
+	}
+#else
+	if(pipe(fds) < 0) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	n->rfd = fds[0];
+	n->wfd = fds[1];
+
+	fcntl(n->rfd, F_SETFL, fcntl(n->rfd, F_GETFL) | O_NONBLOCK);
+	fcntl(n->wfd, F_SETFL, fcntl(n->wfd, F_GETFL) | O_NONBLOCK);
+	fcntl(n->rfd, F_SETFD, FD_CLOEXEC);
+	fcntl(n->wfd, F_SETFD, FD_CLOEXEC);
+#endif
+
+	return n;
+}
+
+void notifier_destroy(Notifier n)
+{
+	close(n->rfd);
+
+	if(n->wfd != n->rfd)
+		close(n->wfd);
+
+	xfree(n);
+}
+
+int notifier_fd(Notifier n)
+{
+	return n->rfd;
+}
+
+void notifier_signal(Notifier n)
+{
+#ifdef HAVE_EVENTFD
+	uint64_t v = 1;
+#else
+	char v = 0;
+#endif
+
+	/* Somebody else has already woken the poller */
+	if(ATOMIC_XCHG(&n->pending, 1))
+		return;
+
+	write(n->wfd, &v, sizeof(v));
+}
+
+/* Called by the polling thread when the notifier becomes readable, before
+   it looks for whatever work it was woken up for.  The descriptor is
+   drained before pending is reset, so a signal which comes in meanwhile
+   either finds pending still set, and its work is found by the look which
+   follows, or writes again once it's reset.  Resetting first would let
+   the read swallow that write, leaving pending set with nothing to read,
+   and every later signal would be ignored */
+void notifier_clear(Notifier n)
+{
+	char buf[64];
+
+#ifdef HAVE_EVENTFD
+	read(n->rfd, buf, sizeof(uint64_t));
+#else
+	while(read(n->rfd, buf, sizeof(buf)) > 0);
+#endif
+
+	ATOMIC_XCHG(&n->pending, 0);
+}
@@ -0,0 +1,23 @@
+/* Notifiers
+
+   A notifier is a descriptor which can be registered with the multiplexer
+   and made readable from any thread, allowing the polling thread to be woken
+   up without signals.  Signals are coalesced: any number of calls to
+   notifier_signal() between two calls to notifier_clear() cause only a
+   single wakeup. */
+
+#ifndef NOTIFIER_H
+#define NOTIFIER_H
+
+typedef struct _Notifier *Notifier;
+
+Notifier notifier_create(void);
+void notifier_destroy(Notifier n);
+
+/* Descriptor to register for MPLX_RD */
+int notifier_fd(Notifier n);
+
+void notifier_signal(Notifier n);
+void notifier_clear(Notifier n);
+
+#endif
@@ -1,71 +1,185 @@
 /* Resource Control Locks
 
    For a detailed explanation, see RCL.h.  This implementation sits on top of
-   POSIX.1 threads and is implemented using mutexes and conditions.
+   POSIX.1 threads and the compiler's atomic builtins.
+
+   Readers don't share a counter.  Each lock has a handful of reader slots,
+   each on a cache line of its own, and every thread always uses the same
+   slot, so an uncontended read lock is an increment of that slot and a
+   check that no writer is about, and unlocking is a decrement.
+
+   A writer first shuts out other writers with a mutex, then raises a flag
+   which turns new readers away, then waits for every slot to drain.  A
+   reader which finds the flag raised backs its increment out and sleeps
+   until the writer is done.
  */
 
+#include <stdint.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <xmalloc.h>
 #include <RCL.h>
+#include <atomic.h>
+
+/* Keeps readers in different slots off each other's cache lines */
+#define CACHE_LINE	64
+
+/* Most reader slots a lock has */
+#define RCL_SLOTS	64
+
+typedef struct _RCLSlot {
+	unsigned long readers;
+	char pad[CACHE_LINE - sizeof(unsigned long)];
+} RCLSlot;
 
 struct _RCL {
-	pthread_mutex_t entry_lock;
-	pthread_mutex_t rc_lock;
-	pthread_cond_t rc_cond;
+	/* Held by the writer from reserving the lock until unlocking it */
+	pthread_mutex_t writer_lock;
+
+	/* Set while there's a writer, which new readers stay away from */
+	int writer;
 
-	unsigned int rc;
+	/* Where a writer waits for readers to leave, and readers wait for
+	   the writer to finish */
+	pthread_mutex_t wait_lock;
+	pthread_cond_t readers_gone, writer_gone;
+
+	RCLSlot *slots;
+	void *slot_memory;
 };
 
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+
+/* Slots per lock, and the next one to hand a thread */
+static unsigned int slot_count = 1;
+static unsigned int next_slot = 0;
+
+static void rcl_once_init(void)
+{
+	long cpus;
+
+	pthread_key_create(&slot_key, NULL);
+
+	/* Twice the CPUs, so threads sharing a slot are rarely running at
+	   the same time */
+	if((cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		cpus = 1;
+
+	while(slot_count < RCL_SLOTS && slot_count < cpus * 2)
+		slot_count <<= 1;
+}
+
+/* The slot the calling thread reads through, the same for every lock */
+static inline unsigned int rcl_slot()
+{
+	uintptr_t s;
+
+	if((s = (uintptr_t)pthread_getspecific(slot_key)) == 0) {
+		s = (ATOMIC_ADD(&next_slot, 1) & (slot_count - 1)) + 1;
+		pthread_setspecific(slot_key, (void *)s);
+	}
+
+	return (unsigned int)s - 1;
+}
+
 RCL rcl_create()
 {
 	RCL ret = NEW(RCL);
+	unsigned int i;
+
+	pthread_once(&slot_once, rcl_once_init);
+
+	pthread_mutex_init(&ret->writer_lock, NULL);
+	pthread_mutex_init(&ret->wait_lock, NULL);
+	pthread_cond_init(&ret->readers_gone, NULL);
+	pthread_cond_init(&ret->writer_gone, NULL);
 
-	pthread_mutex_init(&ret->entry_lock, NULL);
-	pthread_mutex_init(&ret->rc_lock, NULL);
-	pthread_cond_init(&ret->rc_cond, NULL);
+	ret->writer = 0;
 
-	ret->rc = 0;
+	/* Start the slots on a cache line boundary */
+	ret->slot_memory = xmalloc(sizeof(RCLSlot) * slot_count + CACHE_LINE);
+	ret->slots = (RCLSlot *)(((uintptr_t)ret->slot_memory + CACHE_LINE - 1) & ~(uintptr_t)(CACHE_LINE - 1));
+
+	for(i = 0; i < slot_count; i++)
+		ret->slots[i].readers = 0;
 
 	return ret;
 }
 
 void rcl_destroy(RCL rcl)
 {
-	pthread_mutex_destroy(&rcl->entry_lock);
-	pthread_mutex_destroy(&rcl->rc_lock);
-	pthread_cond_destroy(&rcl->rc_cond);
+	pthread_mutex_destroy(&rcl->writer_lock);
+	pthread_mutex_destroy(&rcl->wait_lock);
+	pthread_cond_destroy(&rcl->readers_gone);
+	pthread_cond_destroy(&rcl->writer_gone);
 
+	xfree(rcl->slot_memory);
 	xfree(rcl);
 }
 
+/* Leave a slot, letting a writer know if it might have been waiting on
+   us.  A writer checks the slots under wait_lock, so it can't miss the
+   signal, and the decrement and the load of its flag are both
+   sequentially consistent, so either we see the flag or it sees the slot
+   empty */
+static void rcl_leave(RCL rcl, RCLSlot *slot)
+{
+	if(ATOMIC_SUB(&slot->readers, 1) == 0 && ATOMIC_LOAD_SC(&rcl->writer)) {
+		pthread_mutex_lock(&rcl->wait_lock);
+		pthread_cond_signal(&rcl->readers_gone);
+		pthread_mutex_unlock(&rcl->wait_lock);
+	}
+}
+
 void rcl_read_lock(RCL rcl)
 {
-	pthread_mutex_lock(&rcl->entry_lock);
-	pthread_mutex_lock(&rcl->rc_lock);
-	rcl->rc++;
-	pthread_mutex_unlock(&rcl->rc_lock);
-	pthread_mutex_unlock(&rcl->entry_lock);
+	RCLSlot *slot = &rcl->slots[rcl_slot()];
+
+	for(;;) {
+		/* The increment and the load are both sequentially
+		   consistent, as are the writer's exchange of its flag and
+		   its loads of the slots, so either we see the flag or the
+		   writer sees our increment.  An acquire load here could be
+		   satisfied before the increment was visible, letting us
+		   both miss each other */
+		ATOMIC_ADD(&slot->readers, 1);
+
+		if(!ATOMIC_LOAD_SC(&rcl->writer))
+			return;
+
+		rcl_leave(rcl, slot);
+
+		pthread_mutex_lock(&rcl->wait_lock);
+		while(ATOMIC_LOAD(&rcl->writer))
+			pthread_cond_wait(&rcl->writer_gone, &rcl->wait_lock);
+		pthread_mutex_unlock(&rcl->wait_lock);
+	}
 }
 
 void rcl_read_unlock(RCL rcl)
 {
-	pthread_mutex_lock(&rcl->rc_lock);
-	if(--rcl->rc == 0) 
-		pthread_cond_signal(&rcl->rc_cond);
-	pthread_mutex_unlock(&rcl->rc_lock);
+	rcl_leave(rcl, &rcl->slots[rcl_slot()]);
 }
 
 void rcl_write_reserve_lock(RCL rcl)
 {
-	pthread_mutex_lock(&rcl->entry_lock);
+	pthread_mutex_lock(&rcl->writer_lock);
+	ATOMIC_XCHG(&rcl->writer, 1);
 }
 
 void rcl_write_complete_lock(RCL rcl)
 {
-	pthread_mutex_lock(&rcl->rc_lock);
+	unsigned int i;
 
-	if(rcl->rc > 0)
-		pthread_cond_wait(&rcl->rc_cond, &rcl->rc_lock);
+	pthread_mutex_lock(&rcl->wait_lock);
+
+	/* Sequentially consistent, pairing with rcl_read_lock() */
+	for(i = 0; i < slot_count; i++)
+		while(ATOMIC_LOAD_SC(&rcl->slots[i].readers) > 0)
+			pthread_cond_wait(&rcl->readers_gone, &rcl->wait_lock);
+
+	pthread_mutex_unlock(&rcl->wait_lock);
 }
 
 void rcl_write_lock(RCL rcl)
@@ -76,6 +190,10 @@ void rcl_write_lock(RCL rcl)
 
 void rcl_write_unlock(RCL rcl)
 {
-	pthread_mutex_unlock(&rcl->rc_lock);
-	pthread_mutex_unlock(&rcl->entry_lock);
+	pthread_mutex_lock(&rcl->wait_lock);
+	ATOMIC_STORE(&rcl->writer, 0);
+	pthread_cond_broadcast(&rcl->writer_gone);
+	pthread_mutex_unlock(&rcl->wait_lock);
+
+	pthread_mutex_unlock(&rcl->writer_lock);
 }
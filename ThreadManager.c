@@ -1,115 +1,787 @@
 #include <pthread.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 #include <Config.h>
-#include <Stack.h>
+#include <CpuSet.h>
 #include <HThread.h>
 #include <ThreadManager.h>
+#include <atomic.h>
 #include <log.h>
 #include <output.h>
+#include <util.h>
 #include <xmalloc.h>
 
-static Stack inactive_threads = NULL;
-static int active_thread_count = 0;
-static int max_active_threads;
-static int max_inactive_threads;
+#define WORKER_QUEUE_SIZE	16
 
-static pthread_mutex_t tm_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t tm_cond = PTHREAD_COND_INITIALIZER;
+/* How often, in milliseconds, the manager looks over the pools, the least
+   time it rests between looks however often it's woken, and the least
+   time between two helpers retiring from the same pool */
+#define MANAGER_TICK		100
+#define MANAGER_REST		10
+#define RETIRE_INTERVAL		1000
 
-int tm_init()
+/* Most helpers the manager starts in a pool per look */
+#define SPAWN_BATCH		4
+
+enum {
+	W_FREE,
+	W_RUNNING
+};
+
+typedef struct _Pool *Pool;
+
+/* A job passed back to the helper which suspended it */
+typedef struct _Pinned {
+	struct tm_job j;
+	struct _Pinned *next;
+} *Pinned;
+
+/* A slot in a pool.  Its run queue is a ring of jobs, grown as needed.
+   Jobs passed back with tm_resume() are kept apart, where they can't be
+   stolen, along with a count of those still to come.  An idle helper
+   sleeps on its own condition until it's woken */
+typedef struct _Worker {
+	Pool pool;
+
+	pthread_mutex_t lock;
+	struct tm_job *jobs;
+	int size, start, count;
+
+	Pinned pinned, pinned_tail;
+	int held;
+
+	int state;
+
+	pthread_cond_t cond;
+	int idle, woken;
+} *Worker;
+
+/* The helpers serving one class of job */
+struct _Pool {
+	/* Config variables, and their defaults */
+	char *workers_var, *max_var, *cpus_var;
+	int workers_default, max_default;
+
+	/* CPUs the helpers are bound to, if any */
+	CpuSet cpus;
+
+	/* One slot per thread we're allowed, set aside at startup */
+	Worker workers;
+	int max_threads;
+
+	/* The slots of the running helpers, which are what jobs are spread
+	   over.  Changed under lock, and read without it: a stale entry
+	   still names a real slot, whose state is checked under its own
+	   lock */
+	int *running;
+	int running_count;
+
+	/* Under lock */
+	int target;
+	int live;
+	uint64_t last_retire;
+	pthread_mutex_t lock;
+
+	/* Helpers asleep, jobs waiting for one, where the next job goes,
+	   and a moving average of how long jobs wait, in milliseconds */
+	int idle;
+	int queued;
+	unsigned int next;
+	unsigned int latency;
+};
+
+static struct _Pool pools[TM_CLASSES] = {
+	{ "workers", "max_active_threads", "worker_cpus", DEFAULT_WORKERS, DEFAULT_MAX_ACTIVE_THREADS },
+	{ "file_workers", "file_max_threads", "file_worker_cpus", DEFAULT_FILE_WORKERS, DEFAULT_FILE_MAX_THREADS }
+};
+
+/* With affinity, a connection's jobs go to the same helper, and are only
+   stolen from it once it has more than steal_threshold queued */
+static int affinity;
+static int steal_threshold;
+
+/* Pool sizing.  The manager keeps spare_workers helpers idle in a pool as
+   jobs start to wait, and adds more while they wait longer than
+   latency_target.  Beyond the pool's target, a helper idle for
+   idle_timeout exits */
+static int spare_workers;
+static int idle_timeout;
+static unsigned int latency_target;
+static size_t stack_size;
+
+/* CPUs for the manager and other housekeeping threads */
+static CpuSet misc_cpus = NULL;
+
+static pthread_mutex_t manager_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t manager_cond = PTHREAD_COND_INITIALIZER;
+static int manager_running = 0;
+
+/* The wall clock time msec from now, for pthread_cond_timedwait() */
+static void tm_deadline(struct timespec *ts, int msec)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	ts->tv_sec = tv.tv_sec + msec / 1000;
+	ts->tv_nsec = tv.tv_usec * 1000 + (long)(msec % 1000) * 1000000;
+
+	if(ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* Wake w if it's asleep.  Returns 0 if it wasn't */
+static int worker_wake(Worker w)
+{
+	if(!ATOMIC_XCHG(&w->idle, 0))
+		return 0;
+
+	ATOMIC_SUB(&w->pool->idle, 1);
+
+	pthread_mutex_lock(&w->lock);
+	w->woken = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	return 1;
+}
+
+/* The kth running helper in p, counting round from start, of live */
+static inline Worker pool_running(Pool p, unsigned int start, int k, int live)
+{
+	return p->workers + ATOMIC_LOAD(&p->running[(start + k) % live]);
+}
+
+/* Wake a helper that's asleep, other than w, to steal from w */
+static void worker_wake_any(Worker w)
+{
+	int i, live;
+	Pool p = w->pool;
+	Worker v;
+
+	live = ATOMIC_LOAD(&p->running_count);
+
+	for(i = 0; i < live && ATOMIC_LOAD(&p->idle) > 0; i++)
+		if((v = pool_running(p, w - p->workers, i, live)) != w && worker_wake(v))
+			return;
+}
+
+/* Must hold p->lock */
+static int pool_spawn(Pool p)
 {
 	int i;
-	HThread t;
+	Worker w;
+
+	for(i = 0; i < p->max_threads; i++) {
+		w = p->workers + i;
 
-	pthread_mutex_lock(&tm_mutex);
+		pthread_mutex_lock(&w->lock);
+		if(w->state != W_FREE) {
+			pthread_mutex_unlock(&w->lock);
+			continue;
+		}
 
-	if(inactive_threads == NULL)
-		inactive_threads = stack_create();
+		w->state = W_RUNNING;
+		pthread_mutex_unlock(&w->lock);
 
-	if((max_inactive_threads = config_int_value("threads", "max_inactive_threads")) < 1) {
-		log("*** threads::max_inactive_threads invalid or unspecified, defaulting to %d", DEFAULT_MAX_INACTIVE_THREADS);
-		max_inactive_threads = DEFAULT_MAX_INACTIVE_THREADS;
+		if(hthread_create(w, stack_size) == NULL) {
+			pthread_mutex_lock(&w->lock);
+			w->state = W_FREE;
+			pthread_mutex_unlock(&w->lock);
+
+			return -1;
+		}
+
+		p->running[p->running_count] = i;
+		ATOMIC_STORE(&p->running_count, p->running_count + 1);
+
+		p->live++;
+
+#ifdef DEBUG
+		debug("Spawned %s helper thread (Live: %d)", p->workers_var, p->live);
+#endif
+		return 0;
 	}
 
-	if((max_active_threads = config_int_value("threads", "max_active_threads")) < 1) {
-		log("*** threads::max_active_threads invalid or unspecified, defaulting to %d", DEFAULT_MAX_ACTIVE_THREADS);
-		max_active_threads = DEFAULT_MAX_ACTIVE_THREADS;
+	return -1;
+}
+
+static void pool_init(Pool p)
+{
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+
+	if(p->workers == NULL) {
+		if((p->max_threads = config_int_value("threads", p->max_var)) < 1) {
+			log("*** threads::%s invalid or unspecified, defaulting to %d", p->max_var, p->max_default);
+			p->max_threads = p->max_default;
+		}
+
+		p->workers = NEWV(Worker, p->max_threads);
+		p->running = (int *)xmalloc(sizeof(int) * p->max_threads);
+		p->running_count = 0;
+
+		for(i = 0; i < p->max_threads; i++) {
+			p->workers[i].pool = p;
+			pthread_mutex_init(&p->workers[i].lock, NULL);
+			p->workers[i].jobs = NULL;
+			p->workers[i].size = p->workers[i].start = p->workers[i].count = 0;
+			p->workers[i].pinned = p->workers[i].pinned_tail = NULL;
+			p->workers[i].held = 0;
+			p->workers[i].state = W_FREE;
+			pthread_cond_init(&p->workers[i].cond, NULL);
+			p->workers[i].idle = p->workers[i].woken = 0;
+		}
+
+		if((p->cpus = cpuset_config(p->cpus_var)) != NULL)
+			log("*** threads::%s helper threads bound to CPUs %s", p->workers_var, cpuset_name(p->cpus));
+	}
+
+	if((p->target = config_int_value("threads", p->workers_var)) < 1) {
+		log("*** threads::%s invalid or unspecified, defaulting to %d", p->workers_var, p->workers_default);
+		p->target = p->workers_default;
 	}
 
-	for(i = stack_size(inactive_threads) + active_thread_count; i < max_inactive_threads; i++) {
-		if((t = hthread_create()) != NULL) 
-			stack_push(inactive_threads, t);
-		else
+	if(p->target > p->max_threads) {
+		log("*** threads::%s exceeds threads::%s, using %d", p->workers_var, p->max_var, p->max_threads);
+		p->target = p->max_threads;
+	}
+
+	while(p->live < p->target)
+		if(pool_spawn(p) < 0) {
 			log("!!! Warning: Error spawning thread while populating thread pool");
+			break;
+		}
+
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* How long the oldest job queued in p has been waiting, in milliseconds.
+   Unlike p->latency this grows while every helper is stuck */
+static unsigned int pool_oldest(Pool p)
+{
+	int i, live;
+	Worker w;
+	unsigned int wait, oldest = 0;
+	uint32_t now = (uint32_t)now_msec();
+
+	live = ATOMIC_LOAD(&p->running_count);
+
+	for(i = 0; i < live; i++) {
+		w = pool_running(p, 0, i, live);
+
+		pthread_mutex_lock(&w->lock);
+		if(w->count > 0 && (wait = now - w->jobs[w->start].stamp) > oldest)
+			oldest = wait;
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return oldest;
+}
+
+/* Start helpers in p ahead of demand.  Once jobs take half latency_target
+   to get a helper, bring the idle ones back up to spare_workers, and past
+   latency_target start one for each job left waiting.  Short jobs which
+   merely keep every helper busy don't count, as more threads wouldn't get
+   through them any sooner */
+static void pool_adjust(Pool p)
+{
+	int idle, queued, want = 0;
+	unsigned int latency, oldest;
+
+	idle = ATOMIC_LOAD(&p->idle);
+	queued = ATOMIC_LOAD(&p->queued);
+	latency = ATOMIC_LOAD(&p->latency);
+
+	/* Nothing's picked up while every helper is stuck, so look at how long
+	   the oldest job has been waiting too */
+	if(queued > 0 && latency <= latency_target && (oldest = pool_oldest(p)) > latency)
+		latency = oldest;
+
+	if(latency * 2 > latency_target && idle < spare_workers)
+		want = spare_workers - idle;
+
+	if(latency > latency_target && queued - idle > want)
+		want = queued - idle;
+
+	pthread_mutex_lock(&p->lock);
+
+	if(want > SPAWN_BATCH)
+		want = SPAWN_BATCH;
+
+	while(want-- > 0 && p->live < p->max_threads)
+		if(pool_spawn(p) < 0)
+			break;
+
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void *tm_manager(void *arg)
+{
+	struct timespec ts;
+	int i;
+
+	tm_bind_misc();
+
+	pthread_mutex_lock(&manager_lock);
+
+	for(;;) {
+		tm_deadline(&ts, MANAGER_TICK);
+		pthread_cond_timedwait(&manager_cond, &manager_lock, &ts);
+
+		pthread_mutex_unlock(&manager_lock);
+
+		for(i = 0; i < TM_CLASSES; i++)
+			pool_adjust(pools + i);
+
+		usleep(MANAGER_REST * 1000);
+		pthread_mutex_lock(&manager_lock);
+	}
+
+	return NULL;
+}
+
+/* Have the manager look over the pools now.  If it's busy it'll look again
+   soon enough anyway, so this never waits */
+static void tm_manager_kick()
+{
+	if(pthread_mutex_trylock(&manager_lock) == 0) {
+		pthread_cond_signal(&manager_cond);
+		pthread_mutex_unlock(&manager_lock);
+	}
+}
+
+int tm_init()
+{
+	int i;
+	pthread_t tid;
+
+	affinity = (config_truth_value("threads", "affinity") == 1);
+
+	if((steal_threshold = config_int_value("threads", "steal_threshold")) < 0) {
+		log("*** threads::steal_threshold invalid or unspecified, defaulting to %d", DEFAULT_STEAL_THRESHOLD);
+		steal_threshold = DEFAULT_STEAL_THRESHOLD;
+	}
+
+	if((spare_workers = config_int_value("threads", "spare_workers")) < 0)
+		spare_workers = DEFAULT_SPARE_WORKERS;
+
+	if((idle_timeout = config_int_value("threads", "idle_timeout")) < 1)
+		idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+	if((i = config_int_value("threads", "latency_target")) < 0)
+		i = DEFAULT_LATENCY_TARGET;
+	latency_target = i;
+
+	if((i = config_int_value("threads", "stack_size")) < 1)
+		i = DEFAULT_STACK_SIZE;
+	stack_size = (size_t)i * 1024;
+
+	for(i = 0; i < TM_CLASSES; i++) {
+		if(pools[i].workers == NULL)
+			pthread_mutex_init(&pools[i].lock, NULL);
+
+		pool_init(pools + i);
 	}
 
-	pthread_mutex_unlock(&tm_mutex);
+	if(!manager_running) {
+		if((misc_cpus = cpuset_config("misc_cpus")) != NULL)
+			log("*** Thread manager and tracker bound to CPUs %s", cpuset_name(misc_cpus));
+
+		if(pthread_create(&tid, NULL, tm_manager, NULL))
+			fatal("!!! Fatal error: Couldn't start thread manager");
+
+		pthread_detach(tid);
+		manager_running = 1;
+	}
 
 	return 0;
 }
 
 void tm_destroy()
 {
-	stack_destroy(inactive_threads);
 }
 
-HThread tm_get_thread()
+static void worker_push(Worker w, struct tm_job *j)
 {
-	HThread ret;
+	int i;
+	struct tm_job *jobs;
 
-	pthread_mutex_lock(&tm_mutex);
+	if(w->count == w->size) {
+		jobs = (struct tm_job *)xmalloc(sizeof(struct tm_job) * (w->size ? w->size * 2 : WORKER_QUEUE_SIZE));
 
-#ifdef DEBUG
-	debug("Requesting thread (Active: %d, Inactive: %d)", active_thread_count, stack_size(inactive_threads));
-#endif
+		for(i = 0; i < w->count; i++)
+			jobs[i] = w->jobs[(w->start + i) % w->size];
+
+		if(w->jobs != NULL)
+			xfree(w->jobs);
+
+		w->jobs = jobs;
+		w->size = w->size ? w->size * 2 : WORKER_QUEUE_SIZE;
+		w->start = 0;
+	}
+
+	w->jobs[(w->start + w->count++) % w->size] = *j;
+}
+
+/* Take w's next job, putting any passed back to it first */
+static int worker_pop(Worker w, struct tm_job *j)
+{
+	int ret = 0;
+	Pinned n;
+
+	pthread_mutex_lock(&w->lock);
+
+	if((n = w->pinned) != NULL) {
+		if((w->pinned = n->next) == NULL)
+			w->pinned_tail = NULL;
+		w->held--;
+		pthread_mutex_unlock(&w->lock);
 
-	while(active_thread_count >= max_active_threads)
-		pthread_cond_wait(&tm_cond, &tm_mutex);
+		*j = n->j;
+		xfree(n);
 
-	if((ret = stack_pop(inactive_threads)) == NULL && (ret = hthread_create()) == NULL) {
-		log("!!! Warning: Soft thread count limit exceeds hard limit.  Decrease threads::max_active_threads");
-		pthread_cond_wait(&tm_cond, &tm_mutex);
-		if((ret = stack_pop(inactive_threads)) == NULL) 
-			fatal("!!! Fatal error: Thread pool depleted - system may be low on resources");
+		return 1;
 	}
 
-	active_thread_count++;
+	if(w->count > 0) {
+		*j = w->jobs[w->start];
+		w->start = (w->start + 1) % w->size;
+		w->count--;
+		ret = 1;
+	}
+
+	pthread_mutex_unlock(&w->lock);
 
-	pthread_mutex_unlock(&tm_mutex);
+	if(ret)
+		ATOMIC_SUB(&w->pool->queued, 1);
 
 	return ret;
 }
 
-void tm_return_thread(HThread t)
+/* Take the oldest job from the first helper in the pool, after w, that has
+   work to spare: any at all without affinity, otherwise more than
+   steal_threshold jobs */
+static int worker_steal(Worker w, struct tm_job *j)
 {
-	pthread_mutex_lock(&tm_mutex);
+	int i, live, ret;
+	Worker v;
+	Pool p = w->pool;
 
-	if(stack_size(inactive_threads) >= max_inactive_threads)
-		hthread_destroy(t);
-	else 
-		stack_push(inactive_threads, t);
+	live = ATOMIC_LOAD(&p->running_count);
 
-	active_thread_count--;
-	
-#ifdef DEBUG
-	debug("Thread returned (Active: %d, Inactive: %d)", active_thread_count, stack_size(inactive_threads));
-#endif
+	for(i = 0; i < live; i++) {
+		if((v = pool_running(p, w - p->workers, i, live)) == w)
+			continue;
+
+		ret = 0;
+
+		pthread_mutex_lock(&v->lock);
+		if(v->count > (affinity ? steal_threshold : 0)) {
+			*j = v->jobs[v->start];
+			v->start = (v->start + 1) % v->size;
+			v->count--;
+			ret = 1;
+		}
+		pthread_mutex_unlock(&v->lock);
+
+		if(ret) {
+			ATOMIC_SUB(&p->queued, 1);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Queue j on the first running helper in p, counting from the nth.  Should
+   a helper retire under us, look through every slot before giving up */
+static void tm_dispatch(Pool p, struct tm_job *j, unsigned int n)
+{
+	int i, live, pass, stealable = 0;
+	Worker w = NULL;
+
+	j->stamp = (uint32_t)now_msec();
+	ATOMIC_ADD(&p->queued, 1);
+
+	for(pass = 0; pass < 2; pass++) {
+		live = pass == 0 ? ATOMIC_LOAD(&p->running_count) : p->max_threads;
+
+		for(i = 0; i < live; i++) {
+			if(pass == 0)
+				w = pool_running(p, n, i, live);
+			else
+				w = p->workers + i;
+
+			pthread_mutex_lock(&w->lock);
+			if(w->state == W_RUNNING) {
+				worker_push(w, j);
+				stealable = !affinity || w->count > steal_threshold;
+				pthread_mutex_unlock(&w->lock);
+
+				goto queued;
+			}
+			pthread_mutex_unlock(&w->lock);
+		}
+	}
+
+	fatal("!!! Fatal error: Thread pool depleted - system may be low on resources");
+
+queued:
+	/* Pairs with the exchange in tm_next_job(): either it sees the job,
+	   or we see it's idle */
+	ATOMIC_FENCE();
+
+	if(!worker_wake(w) && stealable)
+		worker_wake_any(w);
+
+	/* Every helper is busy, so more may be needed */
+	if(ATOMIC_LOAD(&p->idle) == 0)
+		tm_manager_kick();
+}
+
+void tm_dispatch_int(tm_class_t cls, uint16_t id, int val)
+{
+	struct tm_job j;
+
+	j.id = id;
+	j.d.v = val;
+
+	tm_dispatch(pools + cls, &j, ATOMIC_ADD(&pools[cls].next, 1));
+}
+
+void tm_dispatch_uid(tm_class_t cls, uint16_t id, int uid)
+{
+	struct tm_job j;
+
+	j.id = id;
+	j.d.v = uid;
+
+	if(affinity)
+		tm_dispatch(pools + cls, &j, (unsigned int)uid * 2654435761U);
+	else
+		tm_dispatch(pools + cls, &j, ATOMIC_ADD(&pools[cls].next, 1));
+}
+
+void tm_dispatch_ptr(tm_class_t cls, uint16_t id, void *data)
+{
+	struct tm_job j;
+
+	j.id = id;
+	j.d.p = data;
+
+	tm_dispatch(pools + cls, &j, ATOMIC_ADD(&pools[cls].next, 1));
+}
+
+void tm_bind_misc()
+{
+	cpuset_bind(misc_cpus, -1);
+}
 
-	pthread_cond_signal(&tm_cond);
-	pthread_mutex_unlock(&tm_mutex);
+void tm_thread_init(HThread t)
+{
+	cpuset_bind(((Worker)hthread_data(t))->pool->cpus, -1);
+}
+
+int tm_queued()
+{
+	int i, n = 0;
+
+	for(i = 0; i < TM_CLASSES; i++)
+		n += ATOMIC_LOAD(&pools[i].queued);
+
+	return n;
+}
+
+tm_class_t tm_class(HThread t)
+{
+	return ((Worker)hthread_data(t))->pool - pools;
+}
+
+/* Fold how long j waited for a helper into p's average, weighting it 1/8.
+   Racing updates may lose a sample, which doesn't matter here */
+static void pool_sample(Pool p, struct tm_job *j)
+{
+	unsigned int l, wait;
+
+	wait = (uint32_t)now_msec() - j->stamp;
+	l = ATOMIC_LOAD(&p->latency);
+
+	ATOMIC_STORE(&p->latency, l - l / 8 + wait / 8);
 }
 
-void tm_handle_crash()
+/* Called by a helper beyond the pool's target which has been idle for
+   idle_timeout.  Helpers retire one at a time, so a pool shrinks gradually
+   after a burst, and never below spare_workers idle.  Returns 1 if w should
+   exit, -1 if it may once another RETIRE_INTERVAL has passed */
+static int worker_retire(Worker w)
 {
-	pthread_mutex_lock(&tm_mutex);
+	Pool p = w->pool;
+	uint64_t now = now_msec();
+	int i, ret = 0;
 
-	active_thread_count--;
-	
+	pthread_mutex_lock(&p->lock);
+
+	if(p->live > p->target && ATOMIC_LOAD(&p->idle) >= spare_workers) {
+		ret = -1;
+
+		if(now - p->last_retire < RETIRE_INTERVAL) {
+			pthread_mutex_unlock(&p->lock);
+			return ret;
+		}
+
+		pthread_mutex_lock(&w->lock);
+		if(w->count == 0 && w->held == 0) {
+			w->state = W_FREE;
+			pthread_mutex_unlock(&w->lock);
+
+			/* Move the last running slot into ours */
+			for(i = 0; p->running[i] != w - p->workers; i++);
+			ATOMIC_STORE(&p->running[i], p->running[p->running_count - 1]);
+			ATOMIC_STORE(&p->running_count, p->running_count - 1);
+
+			p->live--;
+			p->last_retire = now;
 #ifdef DEBUG
-	debug("Thread crashed (Active: %d, Inactive: %d)\n", active_thread_count, stack_size(inactive_threads));
+			debug("%s helper thread exiting (Live: %d)", p->workers_var, p->live);
 #endif
+			pthread_mutex_unlock(&p->lock);
+
+			return 1;
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	pthread_mutex_unlock(&p->lock);
+
+	return ret;
+}
+
+/* Sleep until woken, or until msec have passed.  Returns 1 if we
+   timed out before anyone came to wake us */
+static int worker_sleep(Worker w, int msec)
+{
+	struct timespec ts;
+	int timedout = 0;
+
+	tm_deadline(&ts, msec);
+
+	pthread_mutex_lock(&w->lock);
+	while(!w->woken && !timedout)
+		timedout = (pthread_cond_timedwait(&w->cond, &w->lock, &ts) == ETIMEDOUT);
+
+	if(w->woken) {
+		w->woken = 0;
+		timedout = 0;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	if(!timedout)
+		return 0;
+
+	if(ATOMIC_XCHG(&w->idle, 0)) {
+		ATOMIC_SUB(&w->pool->idle, 1);
+		return 1;
+	}
+
+	/* Somebody's waking us after all */
+	pthread_mutex_lock(&w->lock);
+	while(!w->woken)
+		pthread_cond_wait(&w->cond, &w->lock);
+	w->woken = 0;
+	pthread_mutex_unlock(&w->lock);
+
+	return 0;
+}
+
+int tm_next_job(HThread t, struct tm_job *j)
+{
+	Worker w = (Worker)hthread_data(t);
+	Pool p = w->pool;
+	int wait = idle_timeout * 1000;
+
+	for(;;) {
+		if(worker_pop(w, j) || worker_steal(w, j)) {
+			pool_sample(p, j);
+			return 1;
+		}
+
+		/* Say we're going to sleep, then look once more, so that a job
+		   queued in the meantime either turns up here or wakes us */
+		ATOMIC_ADD(&p->idle, 1);
+		ATOMIC_XCHG(&w->idle, 1);
+
+		if(worker_pop(w, j) || worker_steal(w, j)) {
+			if(ATOMIC_XCHG(&w->idle, 0))
+				ATOMIC_SUB(&p->idle, 1);
+			else {
+				/* Somebody's already waking us */
+				pthread_mutex_lock(&w->lock);
+				while(!w->woken)
+					pthread_cond_wait(&w->cond, &w->lock);
+				w->woken = 0;
+				pthread_mutex_unlock(&w->lock);
+			}
+
+			pool_sample(p, j);
+			return 1;
+		}
+
+		if(!worker_sleep(w, wait)) {
+			wait = idle_timeout * 1000;
+			continue;
+		}
+
+		switch(worker_retire(w)) {
+			case 1:
+				return 0;
+			case -1:
+				/* Surplus, but another helper just went first */
+				wait = RETIRE_INTERVAL;
+				break;
+			default:
+				wait = idle_timeout * 1000;
+				break;
+		}
+	}
+}
+
+void tm_suspend(HThread t)
+{
+	Worker w = (Worker)hthread_data(t);
+
+	pthread_mutex_lock(&w->lock);
+	w->held++;
+	pthread_mutex_unlock(&w->lock);
+}
+
+void tm_resume(HThread t, uint16_t id, void *data)
+{
+	Worker w = (Worker)hthread_data(t);
+	Pinned n;
+
+	n = NEW(Pinned);
+	n->j.id = id;
+	n->j.stamp = (uint32_t)now_msec();
+	n->j.d.p = data;
+	n->next = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if(w->pinned_tail != NULL)
+		w->pinned_tail->next = n;
+	else
+		w->pinned = n;
+	w->pinned_tail = n;
+	pthread_mutex_unlock(&w->lock);
 
-	pthread_cond_signal(&tm_cond);
-	pthread_mutex_unlock(&tm_mutex);
+	/* As in tm_dispatch() */
+	ATOMIC_FENCE();
+	worker_wake(w);
 }
@@ -1,13 +1,85 @@
+/* Thread manager
+
+   Work is carried out by a pool of helper threads, each with its own run
+   queue.  Jobs are spread across the queues as they're dispatched, and a
+   helper which runs out of work steals from the others before it sleeps,
+   so dispatching never waits for a helper to become free.
+
+   Pools grow and shrink with the load.  A manager thread watches how many
+   jobs are queued and how long they wait for a helper.  As waits approach
+   threads::latency_target it starts threads::spare_workers helpers ahead
+   of demand, and past it one for each job left waiting, so threads are
+   never started on the dispatching side.  Helpers beyond a pool's target
+   exit one at a time after threads::idle_timeout idle.
+
+   With threads::affinity set, jobs dispatched with tm_dispatch_uid() are
+   queued on a helper chosen by the connection's uid, so that its state
+   stays in one helper's cache.  Other helpers only steal from one with
+   more than threads::steal_threshold jobs queued.
+
+   Each class of job has a pool of helpers to itself, so that transactions
+   which may spend a long time on the filesystem can't hold up chat. */
+
 #ifndef THREADMANAGER_H
 #define THREADMANAGER_H
 
+#include <global.h>
 #include <HThread.h>
 
+typedef enum {
+	TM_CLASS_CHAT,
+	TM_CLASS_FILES,
+	TM_CLASSES
+} tm_class_t;
+
+/* Job identifiers */
+enum {
+	HT_TRANSACTION,
+	HT_RESUME,
+	HT_OFFLOAD,
+	HT_CONTINUE
+};
+
+/* A job: one of the identifiers above, and its argument.  stamp is set
+   when the job is dispatched */
+struct tm_job {
+	uint16_t id;
+	uint32_t stamp;
+
+	union {
+		int v;
+		void *p;
+	} d;
+};
+
 int tm_init();
 void tm_destroy();
 
-HThread tm_get_thread();
-void tm_return_thread(HThread t);
-void tm_handle_crash();
+void tm_dispatch_int(tm_class_t cls, uint16_t id, int val);
+void tm_dispatch_ptr(tm_class_t cls, uint16_t id, void *data);
+void tm_dispatch_uid(tm_class_t cls, uint16_t id, int uid);
+
+/* Bind the calling thread to threads::misc_cpus, for threads which do
+   occasional housekeeping */
+void tm_bind_misc();
+
+/* Called by helper t as it starts */
+void tm_thread_init(HThread t);
+
+/* Jobs waiting for a helper, across every pool */
+int tm_queued();
+
+/* The class helper t serves */
+tm_class_t tm_class(HThread t);
+
+/* Called by helper t for its next job.  Returns 0 if it should exit */
+int tm_next_job(HThread t, struct tm_job *j);
+
+/* A helper which leaves a job unfinished, to carry on with once some other
+   job is done, first calls tm_suspend().  Whichever helper does that job
+   then passes the rest back with tm_resume(), which queues it for helper t
+   alone.  A helper never exits while it has jobs suspended */
+void tm_suspend(HThread t);
+void tm_resume(HThread t, uint16_t id, void *data);
 
 #endif
@@ -0,0 +1,304 @@
+/*
+   TimerWheel.c: Hierarchical timing wheels
+*/
+
+#include <global.h>
+
+#include <sys/time.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <TimerWheel.h>
+#include <xmalloc.h>
+
+/* Four levels of 64 slots cover 2^24 ticks, a little over 19 days.  Level
+   n holds timers due within 64^(n+1) ticks, and its slots are cascaded
+   down a level each time the level below wraps around */
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	4
+
+#define WHEEL_SPAN	((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+typedef enum {
+	TIMER_PENDING,
+	TIMER_FIRING
+} tstate_t;
+
+struct _Timer {
+	/* Tick the timer is due on */
+	uint64_t expires;
+
+	timer_func_t func;
+	void *arg;
+
+	TimerWheel w;
+	tstate_t state;
+
+	/* Slot list.  pprev points at whatever points at us, so a timer can
+	   be unlinked without knowing which slot it's in */
+	struct _Timer *next, **pprev;
+};
+
+struct _TimerWheel {
+	Timer slots[WHEEL_LEVELS][WHEEL_SIZE];
+
+	/* Next tick to be processed */
+	uint64_t current;
+
+	/* Tick the loop will next wake up on, as of its last call to
+	   timerwheel_next() */
+	uint64_t deadline;
+
+	int count;
+
+	void (*wakeup)(void *ptr);
+	void *ptr;
+
+	pthread_mutex_t lock;
+};
+
+static uint64_t timer_now_msec(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+static void timer_link(TimerWheel w, Timer t)
+{
+	uint64_t when;
+	Timer *slot;
+	int level;
+
+	when = t->expires < w->current ? w->current : t->expires;
+
+	/* Anything further out than the wheel can hold is parked in the top
+	   level, and cascaded back up there until it's in range */
+	if(when - w->current >= WHEEL_SPAN)
+		when = w->current + WHEEL_SPAN - 1;
+
+	for(level = 0; level < WHEEL_LEVELS - 1; level++)
+		if(when - w->current < ((uint64_t)1 << (WHEEL_BITS * (level + 1))))
+			break;
+
+	slot = &w->slots[level][(when >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+	if((t->next = *slot) != NULL)
+		t->next->pprev = &t->next;
+
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void timer_unlink(Timer t)
+{
+	if(t->next != NULL)
+		t->next->pprev = t->pprev;
+
+	*t->pprev = t->next;
+}
+
+/* Redistribute a slot from a higher level among the levels below it */
+static void timer_cascade(TimerWheel w, int level, int index)
+{
+	Timer t, n;
+
+	t = w->slots[level][index];
+	w->slots[level][index] = NULL;
+
+	for(; t != NULL; t = n) {
+		n = t->next;
+		timer_link(w, t);
+	}
+}
+
+TimerWheel timerwheel_create(void (*wakeup)(void *ptr), void *ptr)
+{
+	TimerWheel w = NEW(TimerWheel);
+	int i, j;
+
+	for(i = 0; i < WHEEL_LEVELS; i++)
+		for(j = 0; j < WHEEL_SIZE; j++)
+			w->slots[i][j] = NULL;
+
+	w->current = timer_now_msec() / TIMER_TICK;
+	w->deadline = UINT64_MAX;
+	w->count = 0;
+
+	w->wakeup = wakeup;
+	w->ptr = ptr;
+
+	pthread_mutex_init(&w->lock, NULL);
+
+	return w;
+}
+
+void timerwheel_destroy(TimerWheel w)
+{
+	Timer t, n;
+	int i, j;
+
+	for(i = 0; i < WHEEL_LEVELS; i++)
+		for(j = 0; j < WHEEL_SIZE; j++)
+			for(t = w->slots[i][j]; t != NULL; t = n) {
+				n = t->next;
+				xfree(t);
+			}
+
+	pthread_mutex_destroy(&w->lock);
+	xfree(w);
+}
+
+Timer timerwheel_add(TimerWheel w, int msec, timer_func_t func, void *arg)
+{
+	Timer t = NEW(Timer);
+	uint64_t now;
+	int wakeup = 0;
+
+	if(msec < 0)
+		msec = 0;
+
+	now = timer_now_msec() / TIMER_TICK;
+
+	t->expires = now + (msec + TIMER_TICK - 1) / TIMER_TICK;
+	t->func = func;
+	t->arg = arg;
+	t->w = w;
+	t->state = TIMER_PENDING;
+
+	pthread_mutex_lock(&w->lock);
+
+	/* Nothing has been processed since the wheel went idle, so there's
+	   no need to catch up on those ticks */
+	if(w->count == 0)
+		w->current = now;
+
+	timer_link(w, t);
+	w->count++;
+
+	if(t->expires < w->deadline) {
+		w->deadline = t->expires;
+		wakeup = 1;
+	}
+
+	pthread_mutex_unlock(&w->lock);
+
+	if(wakeup && w->wakeup != NULL)
+		w->wakeup(w->ptr);
+
+	return t;
+}
+
+int timerwheel_cancel(Timer t)
+{
+	TimerWheel w = t->w;
+
+	pthread_mutex_lock(&w->lock);
+
+	/* The wheel frees it once the callback returns */
+	if(t->state != TIMER_PENDING) {
+		pthread_mutex_unlock(&w->lock);
+		return -1;
+	}
+
+	timer_unlink(t);
+	w->count--;
+
+	pthread_mutex_unlock(&w->lock);
+
+	xfree(t);
+
+	return 0;
+}
+
+int timerwheel_next(TimerWheel w)
+{
+	uint64_t when, now;
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+
+	if(w->count == 0) {
+		w->deadline = UINT64_MAX;
+		pthread_mutex_unlock(&w->lock);
+
+		return -1;
+	}
+
+	/* Only the lowest level is searched.  If it's empty, wake up when the
+	   next slot of the level above is cascaded into it */
+	for(i = 0; i < WHEEL_SIZE; i++)
+		if(w->slots[0][(w->current + i) & WHEEL_MASK] != NULL)
+			break;
+
+	if(i < WHEEL_SIZE)
+		when = w->current + i;
+	else
+		when = (w->current | WHEEL_MASK) + 1;
+
+	w->deadline = when;
+
+	pthread_mutex_unlock(&w->lock);
+
+	now = timer_now_msec();
+
+	return when * TIMER_TICK > now ? (int)(when * TIMER_TICK - now) : 0;
+}
+
+void timerwheel_run(TimerWheel w)
+{
+	Timer t, n, expired = NULL, *tail = &expired;
+	uint64_t now;
+	int level, index;
+
+	now = timer_now_msec() / TIMER_TICK;
+
+	pthread_mutex_lock(&w->lock);
+
+	while(w->count > 0 && w->current <= now) {
+		index = w->current & WHEEL_MASK;
+
+		/* Each time a level wraps, pull the next slot down from the
+		   level above it */
+		for(level = 1; level < WHEEL_LEVELS && index == 0; level++) {
+			index = (w->current >> (WHEEL_BITS * level)) & WHEEL_MASK;
+			timer_cascade(w, level, index);
+		}
+
+		index = w->current & WHEEL_MASK;
+
+		for(t = w->slots[0][index]; t != NULL; t = t->next) {
+			t->state = TIMER_FIRING;
+			w->count--;
+		}
+
+		/* Move the whole slot onto the expired list */
+		if((*tail = w->slots[0][index]) != NULL) {
+			w->slots[0][index] = NULL;
+
+			for(t = *tail; t->next != NULL; t = t->next);
+			tail = &t->next;
+		}
+
+		w->current++;
+	}
+
+	pthread_mutex_unlock(&w->lock);
+
+	for(t = expired; t != NULL; t = n) {
+		n = t->next;
+
+		t->func(t->arg);
+		xfree(t);
+	}
+}
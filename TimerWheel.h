@@ -0,0 +1,42 @@
+/* Timer wheels
+
+   A hierarchical timing wheel, driven by an event loop.  Timers may be
+   armed and cancelled in constant time from any thread, and fire from the
+   thread which calls timerwheel_run().  Resolution is TIMER_TICK
+   milliseconds.
+
+   The loop sleeps for timerwheel_next() milliseconds between runs.  When a
+   timer is armed which is due before the loop would otherwise wake up, the
+   wakeup function given to timerwheel_create() is called so the loop can
+   recalculate its timeout. */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+/* Milliseconds per tick */
+#define TIMER_TICK	100
+
+typedef struct _TimerWheel *TimerWheel;
+typedef struct _Timer *Timer;
+
+typedef void (*timer_func_t)(void *arg);
+
+TimerWheel timerwheel_create(void (*wakeup)(void *ptr), void *ptr);
+void timerwheel_destroy(TimerWheel w);
+
+/* Call func with arg once msec milliseconds have passed */
+Timer timerwheel_add(TimerWheel w, int msec, timer_func_t func, void *arg);
+
+/* Returns 0 if the timer was cancelled, or -1 if it has already begun
+   firing.  Either way the handle must not be used afterwards.  Callbacks
+   run without the wheel locked, so a callback racing with its cancellation
+   must check for itself whether it's still wanted */
+int timerwheel_cancel(Timer t);
+
+/* Milliseconds until the next timer is due, or -1 if none are armed */
+int timerwheel_next(TimerWheel w);
+
+/* Fire every timer which is due */
+void timerwheel_run(TimerWheel w);
+
+#endif
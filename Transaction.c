@@ -1,16 +1,17 @@
 #include <global.h>
 
 #include <sys/uio.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include <ConnectionManager.h>
 #include <Permissions.h>
 #include <Transaction.h>
 #include <machdep.h>
-#include <socketops.h>
 #include <xmalloc.h>
 
 #ifdef DEBUG
@@ -46,37 +47,213 @@ struct _TransactionOut {
 	uint16_t obj_count, max_objects;
 	struct iovec *iov;
 	uint8_t header[22];
+
+	/* Length and object count in network byte order, as written, and
+	   whether they're filled in for good */
+	uint32_t n_length;
+	uint16_t n_obj_count;
+	int sealed;
+};
+
+/* Size of the first read on a connection.  Buffers grow as far as one
+   maximum sized transaction if need be */
+#define TXN_BUFFER_SIZE	4096
+
+/* Header length, including the object count */
+#define TXN_HEADER_SIZE	22
+
+struct _TransactionBuffer {
+	uint8_t *data;
+	uint32_t size, start, end;
+
+	/* Transactions in [start, complete) have arrived in full */
+	uint32_t complete;
+	int count;
+
+	/* Set once the connection is closed, fails, or sends something which
+	   can't be a transaction */
+	int failed;
+};
+
+struct _TransactionQueue {
+	uint8_t *data;
+	uint32_t size, start, end;
+
+	/* Set once a write has failed */
+	int failed;
 };
 
-/* Read an incoming transaction and create a transaction object.  Zero copy */
-TransactionIn transaction_read(int fd)
+TransactionBuffer transaction_buffer_create(void)
+{
+	TransactionBuffer b = NEW(TransactionBuffer);
+
+	b->size = TXN_BUFFER_SIZE;
+	b->data = (uint8_t *)xmalloc(b->size);
+	b->start = b->end = b->complete = 0;
+	b->count = 0;
+	b->failed = 0;
+
+	return b;
+}
+
+void transaction_buffer_destroy(TransactionBuffer b)
+{
+	xfree(b->data);
+	xfree(b);
+}
+
+/* Body length of the transaction whose header starts at p, or -1 if it's
+   too large to be believed */
+static int32_t transaction_body_length(uint8_t *p)
 {
-	TransactionIn t;
-	uint8_t header[22], *bptr;
-	uint16_t max_objects;
 	uint32_t length;
 
-#ifndef HOST_BIGENDIAN
-	uint16_t v16;
+	memcpy(&length, p + 12, 4);
+	length = ntohl(length) - 2;
+
+	if(length > MAX_TXN_SIZE) {
+#ifdef DEBUG
+		debug("*** TXN_ERR: Too long");
 #endif
+		return -1;
+	}
+
+	return length;
+}
+
+/* Count the transactions which have become complete */
+static void transaction_buffer_scan(TransactionBuffer b)
+{
+	int32_t length;
+
+	while(b->end - b->complete >= TXN_HEADER_SIZE) {
+		if((length = transaction_body_length(b->data + b->complete)) < 0) {
+			b->failed = 1;
+			return;
+		}
+
+		if(b->end - b->complete < TXN_HEADER_SIZE + length)
+			return;
+
+		b->complete += TXN_HEADER_SIZE + length;
+		b->count++;
+	}
+}
+
+int transaction_buffer_fill(TransactionBuffer b, int fd)
+{
+	ssize_t r;
+	uint32_t need;
+
+	while(!b->failed) {
+		if(b->end == b->size) {
+			/* Let what's already here be handled before reading
+			   any more */
+			if(b->count > 0)
+				break;
+
+			/* Otherwise make room for the rest of the transaction
+			   at the front of the buffer.  The scan has already
+			   checked its length */
+			need = TXN_HEADER_SIZE + transaction_body_length(b->data + b->complete);
+			b->size = need > b->size * 2 ? need : b->size * 2;
+			b->data = (uint8_t *)xrealloc(b->data, b->size);
+		}
+
+		if((r = recv(fd, b->data + b->end, b->size - b->end, 0)) > 0) {
+			b->end += r;
+			transaction_buffer_scan(b);
+			continue;
+		}
+
+		if(r < 0 && errno == EINTR)
+			continue;
+
+		if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
 
-	if(read_all(fd, header, 22) < 0) {
 #ifdef DEBUG
-		debug("*** TXN_ERR: read() error while reading header");
+		debug("*** TXN_ERR: Connection closed while reading");
 #endif
-		return NULL;
+		b->failed = 1;
 	}
 
+	return b->failed ? -1 : b->count;
+}
+
+TransactionBuffer transaction_buffer_split(TransactionBuffer b)
+{
+	TransactionBuffer ret = NEW(TransactionBuffer);
+	uint32_t tail = b->end - b->complete;
+
+	/* The complete transactions keep the storage, and the partial one
+	   which follows them is moved to a new buffer */
+	ret->data = b->data;
+	ret->size = b->size;
+	ret->start = b->start;
+	ret->end = ret->complete = b->complete;
+	ret->count = b->count;
+	ret->failed = b->failed;
+
+	b->size = tail > TXN_BUFFER_SIZE ? tail : TXN_BUFFER_SIZE;
+	b->data = (uint8_t *)xmalloc(b->size);
+	memcpy(b->data, ret->data + ret->complete, tail);
+	b->start = b->complete = 0;
+	b->end = tail;
+	b->count = 0;
+
+	return ret;
+}
+
+int transaction_buffer_failed(TransactionBuffer b)
+{
+	return b->failed;
+}
+
+/* Create a transaction object for the next complete transaction.  Zero
+   copy: the objects point into the buffer, which must outlive them */
+int transaction_buffer_peek(TransactionBuffer b)
+{
+	uint16_t v16;
+
+	if(b->count == 0)
+		return -1;
+
+	memcpy(&v16, b->data + b->start + 2, 2);
+
+	return ntohs(v16);
+}
+
+TransactionIn transaction_buffer_next(TransactionBuffer b)
+{
+	TransactionIn t;
+	uint8_t *header, *bptr;
+	uint16_t max_objects, v16;
+	uint32_t length, v32;
+
+	if(b->count == 0)
+		return NULL;
+
+	header = b->data + b->start;
+	length = transaction_body_length(header);
+
+	b->start += TXN_HEADER_SIZE + length;
+	b->count--;
+
 	t = NEW(TransactionIn);
 
-	/* Hopefully these are aligned properly as not to cause bus errors.
-	   Otherwise this whole thing may need to be rewritten with memcpys */
-	t->t_class = ntohs(*(uint16_t *)header);
-	t->t_id = ntohs(*(uint16_t *)(header + 2));
-	t->t_taskno = ntohl(*(uint32_t *)(header + 4));
-	t->t_error = ntohl(*(uint32_t *)(header + 8));
-	length = ntohl(*(uint32_t *)(header + 12)) - 2;
-	max_objects = ntohs(*(uint16_t *)(header + 20));
+	/* Transactions may start anywhere in the buffer, so the header is
+	   copied out rather than risk bus errors */
+	memcpy(&v16, header, 2);
+	t->t_class = ntohs(v16);
+	memcpy(&v16, header + 2, 2);
+	t->t_id = ntohs(v16);
+	memcpy(&v32, header + 4, 4);
+	t->t_taskno = ntohl(v32);
+	memcpy(&v32, header + 8, 4);
+	t->t_error = ntohl(v32);
+	memcpy(&v16, header + 20, 2);
+	max_objects = ntohs(v16);
 
 #ifdef DEBUG
 	debug("--- | INCOMING TRANSACTION | ---");
@@ -84,29 +261,22 @@ TransactionIn transaction_read(int fd)
 	debug("Objects: %d", max_objects);
 #endif
 
-	if(length > MAX_TXN_SIZE || max_objects > MAX_TXN_OBJS) {
+	if(max_objects > MAX_TXN_OBJS) {
 #ifdef DEBUG
-		debug("*** TXN_ERR: Too long or too many objects");
+		debug("*** TXN_ERR: Too many objects");
 #endif
 		goto err0;
 	}
 
+	t->buffer = header + TXN_HEADER_SIZE;
+
 	if(max_objects == 0 || length == 0) {
-		t->buffer = NULL;
 		t->object = NULL;
 		t->obj_count = 0;
 
 		return t;
 	}
 
-	t->buffer = (uint8_t *)xmalloc(length);
-	if(read_all(fd, t->buffer, length) < 0) {
-#ifdef DEBUG
-		debug("*** TXN_ERR: read() error reading body");
-#endif
-		goto err1;
-	}
-
 	t->object = (struct TransactionObject *)
 		xmalloc(max_objects * sizeof(struct TransactionObject));
 
@@ -115,7 +285,7 @@ TransactionIn transaction_read(int fd)
 #ifdef DEBUG
 			debug("*** TXN_ERR: Length mismatch in object header");
 #endif
-			goto err2;
+			goto err1;
 		}
 
 #if HOST_BIGENDIAN
@@ -142,7 +312,7 @@ TransactionIn transaction_read(int fd)
 #ifdef DEBUG
 			debug("*** TXN_ERR: Length mismatch in object body");
 #endif
-			goto err2;
+			goto err1;
 		}
 
 #ifdef DEBUG
@@ -160,19 +330,23 @@ TransactionIn transaction_read(int fd)
 
 	return t;
 
-err2:
-	xfree(t->object);
 err1:
-	xfree(t->buffer);
+	xfree(t->object);
 err0:
 	xfree(t);
+
+	/* Nothing after a malformed transaction can be trusted */
+	b->failed = 1;
+	b->count = 0;
+
 	return NULL;
 }
 
 void transaction_in_destroy(TransactionIn t)
 {
-	xfree(t->object);
-	xfree(t->buffer);
+	if(t->object != NULL)
+		xfree(t->object);
+
 	xfree(t);
 }
 
@@ -385,6 +559,15 @@ static void transaction_iov_init(TransactionOut t)
 
 	t->iov[3].iov_len = 4;
 	t->iov[3].iov_base = (char *)&t->t_error;
+
+	t->iov[4].iov_len = 4;
+	t->iov[4].iov_base = (char *)&t->n_length;
+
+	t->iov[5].iov_len = 4;
+	t->iov[5].iov_base = (char *)&t->n_length;
+
+	t->iov[6].iov_len = 2;
+	t->iov[6].iov_base = (char *)&t->n_obj_count;
 }
 
 TransactionOut transaction_create(uint16_t tid, uint16_t objects)
@@ -402,6 +585,7 @@ TransactionOut transaction_create(uint16_t tid, uint16_t objects)
 	t->length = 2;
 	t->obj_count = 0;
 	t->max_objects = objects;
+	t->sealed = 0;
 
 	transaction_iov_init(t);
 
@@ -420,6 +604,7 @@ TransactionOut transaction_reply_create(TransactionIn t, uint32_t errorcode, uin
 	ret->length = 2;
 	ret->obj_count = 0;
 	ret->max_objects = objects;
+	ret->sealed = 0;
 
 	transaction_iov_init(ret);
 
@@ -527,29 +712,86 @@ void transaction_add_timestamp(TransactionOut t, uint16_t type, time_t timestamp
 	transaction_add_object(t, type, ts, 8);
 }
 
+int transaction_is_reply(TransactionOut t)
+{
+	return t->t_class != 0;
+}
+
 int transaction_write(int fd, TransactionOut t)
 {
-	uint16_t obj_count;
-	uint32_t taskno, length;
+	return cm_transaction_write(fd, t);
+}
 
-	if(!t->t_class) {
-		if((taskno = cm_get_taskno(fd)) < 0)
-			return -1;
+TransactionQueue transaction_queue_create(void)
+{
+	TransactionQueue q = NEW(TransactionQueue);
 
-		t->t_taskno = htonl(taskno);
+	/* Most connections never queue anything, so storage is only
+	   allocated once it's needed */
+	q->data = NULL;
+	q->size = q->start = q->end = 0;
+	q->failed = 0;
+
+	return q;
+}
+
+void transaction_queue_destroy(TransactionQueue q)
+{
+	if(q->data != NULL)
+		xfree(q->data);
+
+	xfree(q);
+}
+
+static void transaction_queue_append(TransactionQueue q, void *buf, uint32_t len)
+{
+	if(q->size - q->end < len) {
+		/* Reuse the space at the front before growing */
+		if(q->start > 0) {
+			memmove(q->data, q->data + q->start, q->end - q->start);
+			q->end -= q->start;
+			q->start = 0;
+		}
+
+		if(q->size - q->end < len) {
+			if(q->size == 0)
+				q->size = TXN_BUFFER_SIZE;
+
+			while(q->size - q->end < len)
+				q->size *= 2;
+
+			q->data = (uint8_t *)xrealloc(q->data, q->size);
+		}
 	}
 
-	length = htonl(t->length);
-	obj_count = htons(t->obj_count);
+	memcpy(q->data + q->end, buf, len);
+	q->end += len;
+}
 
-	t->iov[4].iov_len = 4;
-	t->iov[4].iov_base = (char *)&length;
+void transaction_seal(TransactionOut t)
+{
+	t->n_length = htonl(t->length);
+	t->n_obj_count = htons(t->obj_count);
+	t->sealed = 1;
+}
 
-	t->iov[5].iov_len = 4;
-	t->iov[5].iov_base = (char *)&length;
+int transaction_queue_write(TransactionQueue q, int fd, TransactionOut t, uint32_t taskno)
+{
+	struct iovec *v = t->iov;
+	int iovcnt = 7 + t->obj_count;
+	ssize_t r = 0;
 
-	t->iov[6].iov_len = 2;
-	t->iov[6].iov_base = (char *)&obj_count;
+	if(q->failed)
+		return -1;
+
+	/* Replies carry the task number of the request they answer */
+	if(!t->t_class)
+		t->t_taskno = htonl(taskno);
+
+	if(!t->sealed) {
+		t->n_length = htonl(t->length);
+		t->n_obj_count = htons(t->obj_count);
+	}
 
 #ifdef DEBUG
 	debug("--- | OUTGOING TRANSACTION | ---");
@@ -557,11 +799,76 @@ int transaction_write(int fd, TransactionOut t)
 	debug("t_id:     %d", ntohs(t->t_id));
 	debug("t_taskno: %d", ntohl(t->t_taskno));
 	debug("t_error:  %d", ntohl(t->t_error));
-	debug("length:   %d", ntohl(length));
-	debug("objcnt:   %d", ntohs(obj_count));
+	debug("length:   %d", t->length);
+	debug("objcnt:   %d", t->obj_count);
 
-	debug("Writing iovec %p of %d entries to %d", t->iov, 7 + t->obj_count, fd);
+	debug("Writing iovec %p of %d entries to %d", t->iov, iovcnt, fd);
 #endif
 
-	return writev(fd, t->iov, 7 + t->obj_count);
+	/* Nothing may overtake what's already queued */
+	if(q->end == q->start) {
+		while((r = writev(fd, v, iovcnt)) < 0 && errno == EINTR);
+
+		if(r < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				q->failed = 1;
+				return -1;
+			}
+
+			r = 0;
+		}
+	}
+
+	/* Queue whatever the socket wouldn't take */
+	for(; iovcnt > 0; v++, iovcnt--) {
+		if((size_t)r >= v->iov_len) {
+			r -= v->iov_len;
+			continue;
+		}
+
+		transaction_queue_append(q, (uint8_t *)v->iov_base + r, v->iov_len - r);
+		r = 0;
+	}
+
+	return q->end - q->start;
+}
+
+int transaction_queue_flush(TransactionQueue q, int fd)
+{
+	ssize_t r;
+
+	if(q->failed)
+		return -1;
+
+	while(q->end > q->start) {
+		if((r = send(fd, q->data + q->start, q->end - q->start, 0)) > 0) {
+			q->start += r;
+			continue;
+		}
+
+		if(r < 0 && errno == EINTR)
+			continue;
+
+		if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return q->end - q->start;
+
+		q->failed = 1;
+		return -1;
+	}
+
+	/* Give back whatever a burst made the queue grow to */
+	if(q->size > TXN_BUFFER_SIZE) {
+		xfree(q->data);
+		q->data = NULL;
+		q->size = 0;
+	}
+
+	q->start = q->end = 0;
+
+	return 0;
+}
+
+uint32_t transaction_queue_length(TransactionQueue q)
+{
+	return q->end - q->start;
 }
@@ -7,7 +7,30 @@
 typedef struct _TransactionIn *TransactionIn;
 typedef struct _TransactionOut *TransactionOut;
 
-TransactionIn transaction_read(int fd);
+/* Each control connection has an input buffer, which is filled with large
+   non-blocking reads.  Complete transactions are split off together and
+   parsed in place */
+typedef struct _TransactionBuffer *TransactionBuffer;
+
+TransactionBuffer transaction_buffer_create(void);
+void transaction_buffer_destroy(TransactionBuffer b);
+
+/* Read everything available without blocking.  Returns the number of
+   complete transactions buffered, or -1 if the connection has failed */
+int transaction_buffer_fill(TransactionBuffer b, int fd);
+
+/* Move the complete transactions into a buffer of their own, leaving any
+   partial transaction behind */
+TransactionBuffer transaction_buffer_split(TransactionBuffer b);
+int transaction_buffer_failed(TransactionBuffer b);
+
+/* Returns NULL once every complete transaction has been parsed, or if one
+   was malformed, in which case the buffer is marked as failed */
+TransactionIn transaction_buffer_next(TransactionBuffer b);
+
+/* The ID of the transaction transaction_buffer_next() would return, or -1
+   if there are none left */
+int transaction_buffer_peek(TransactionBuffer b);
 void transaction_in_destroy(TransactionIn);
 uint16_t transaction_id(TransactionIn t);
 uint32_t transaction_taskno(TransactionIn t);
@@ -32,8 +55,33 @@ void transaction_add_int32(TransactionOut t, uint16_t type, uint32_t value);
 void transaction_add_string(TransactionOut t, uint16_t type, char *string);
 void transaction_add_masked_string(TransactionOut t, uint16_t type, char *string);
 void transaction_add_timestamp(TransactionOut t, uint16_t type, time_t timestamp);
+int transaction_is_reply(TransactionOut t);
+
+/* Write to a control connection through its output queue */
 int transaction_write(int fd, TransactionOut t);
 
+/* Each control connection also has an output queue.  Transactions are
+   written straight to the socket while nothing is queued ahead of them,
+   and whatever the socket won't take without blocking is queued until the
+   event loop finds it writable again */
+typedef struct _TransactionQueue *TransactionQueue;
+
+TransactionQueue transaction_queue_create(void);
+void transaction_queue_destroy(TransactionQueue q);
+
+/* Fill in t's header lengths, which is otherwise done each time it's
+   written.  Nothing more may be added to it afterwards */
+void transaction_seal(TransactionOut t);
+
+/* Write t to fd, or queue it.  Requests are stamped with taskno.  Returns
+   the number of bytes left queued, or -1 if the connection has failed */
+int transaction_queue_write(TransactionQueue q, int fd, TransactionOut t, uint32_t taskno);
+
+/* Write out as much of the queue as the socket will take.  Returns the
+   number of bytes left queued, or -1 if the connection has failed */
+int transaction_queue_flush(TransactionQueue q, int fd);
+uint32_t transaction_queue_length(TransactionQueue q);
+
 #ifdef DEBUG
 void transaction_print(TransactionIn t);
 #endif
@@ -1,6 +1,4 @@
 #include <global.h>
-#include <sys/time.h>
-#include <time.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <string.h>
@@ -8,10 +6,11 @@
 #include <Collection.h>
 #include <Config.h>
 #include <ConnectionManager.h>
-#include <HThread.h>
 #include <IDM.h>
+#include <TimerWheel.h>
 #include <Transaction.h>
 #include <TransferManager.h>
+#include <connection_handler.h>
 #include <hlid.h>
 #include <output.h>
 #include <transfer_handler.h>
@@ -37,13 +36,13 @@
    definition below for specific time) for a connection on the data port to
    be abritrated.
 
-   In order to facilitate this timeout, a monitor thread is spawned.  This
-   thread iterates a "sequester list".  Once the server notifies a client
-   that its download slot is ready, its transfer is placed into this list.
-   The monitor thread then waits for a transfer thread to signal it that
-   a sequestered transfer has begun.  If the alloted period of time goes
-   by without the thread being signaled, then it will drop the download
-   entirely and allow another transfer to take its spot.
+   In order to facilitate this timeout, once the server notifies a client
+   that its download slot is ready its transfer is "sequestered": a timer
+   is armed on the timer wheel of the event loop which owns the client's
+   connection.  Registering the transfer cancels the timer and begins the
+   transfer.  If the alloted period of time goes by without the transfer
+   being registered, the timer drops the download entirely and allows
+   another transfer to take its spot.
 
 TESTING:
 
@@ -53,7 +52,7 @@ Any inconsistancies in this behaviour should be reported as bugs.
 
 State - Download queue is empty, active transfers <= max transfers
 Action - A new download is requested
-Behaviour - Download is added directly to sequester list
+Behaviour - Download is sequestered directly
 Testing - Empirical testing shows this to be implemented properly
 
 State - Download queue is empty, all download slots full
@@ -61,19 +60,14 @@ Action - A new download is requested
 Behaviour - Download is added to queue
 Testing - Empirical testing shows this to be implemented properly
 
-State - Transfer is first in sequester list, monitor thread waiting
+State - Transfer is sequestered
 Action - Transfer is registered before timeout elapses
-Behaviour - Transfer should be remove from sequester list and started
+Behaviour - Timer should be cancelled, and the transfer engine given the transfer
 Testing - Empirical testing shows this to be implemented properly
 
-State - Transfer is first in sequester list, monitor thread waiting
+State - Transfer is sequestered
 Action - Registration timeout elapses without a data connection
-Behaviour - Transfer should be purged, monitor thread iterates list
-Testing - XXX No testing of this behaviour has been done
-
-State - Transfer is in sequester list but not first
-Action - Transfer is registered
-Behaviour - Transfer should be removed from sequester list, download thread should be notified and transfer begun
+Behaviour - Transfer should be purged, and the next queued transfer sequestered
 Testing - XXX No testing of this behaviour has been done
 
 State - Transfer is in download queue
@@ -83,12 +77,12 @@ Testing - XXX No testing of this behaviour has been done
 
 State - Transfer is first in queue and not registered
 Action - An active download is completed or terminated
-Behaviour - Transfer should be moved to sequester list
+Behaviour - Transfer should be sequestered
 Testing - Empirical testing shows this to be implemented properly
 
 State - Transfer is first in queue and registered
 Action - An active download is completed or terminated
-Behaviour - Download thread should be notified and transfer begun
+Behaviour - The transfer engine should be given the transfer
 Testing - XXX No testing of this behaviour has been done
 */
 
@@ -107,9 +101,17 @@ typedef struct _Transfer {
 	int offset;
 	int position;
 
+	/* The data connection, once registered.  Until the transfer is
+	   activated it's simply parked here, without a thread.  Then it
+	   belongs to xfer, which runs the transfer */
 	int fd;
-	HThread thread;
-	struct timespec ts;
+	Xfer xfer;
+
+	/* Data connection timeout, armed while the transfer is sequestered.
+	   The key tells its expiry apart from that of an earlier transfer
+	   which had the same ID */
+	Timer timer;
+	uintptr_t key;
 } *Transfer;
 
 typedef struct _QueueNode {
@@ -117,26 +119,28 @@ typedef struct _QueueNode {
 	struct _QueueNode *l;
 } *QueueNode;
 
+/* Transfer IDs fit in the low bits of a timer key */
+#define KEY_TID_BITS	16
+
 static pthread_mutex_t tfm_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t tfm_cond = PTHREAD_COND_INITIALIZER;
 
 /* Structures */
 static IDM tfm_idm = NULL;
 static QueueNode q_head = NULL, q_tail = NULL;
-static QueueNode seq_head = NULL, seq_tail = NULL;
 static Collection ttbl = NULL;
 
 /* State variables */
 static int queue_size = 0;
 static int active_downloads = 0, active_uploads = 0;
+static unsigned int key_generation = 0;
 
 /* Limit variables */
 static int queue_enable = 1;
 static int max_downloads = -1;
 static int max_uploads = -1;
 
-/* Prototype for monitor thread function */
-static void *monitor_thread(void *arg);
+/* Prototype for sequester timeout function */
+static void sequester_expire(void *arg);
 
 static void transfer_destroy(Transfer t)
 {
@@ -145,6 +149,9 @@ static void transfer_destroy(Transfer t)
 	if(t->fd != -1)
 		close(t->fd);
 
+	if(t->xfer != NULL)
+		xfer_abort(t->xfer);
+
 	if(t->filename != NULL)
 		xfree(t->filename);
 
@@ -165,36 +172,49 @@ static void activate_upload(Transfer t)
 {
 	TransferInfo d = NEW(TransferInfo);
 
+	d->fd = t->fd;
+	d->tid = t->tid;
 	d->filename = xstrdup(t->filename);
 	d->mode	= t->mode;
 	d->offset = t->offset;
 
-	mqueue_send_ptr(hthread_queue(t->thread), HT_UPLOAD, d);
+	t->xfer = xfer_upload(d);
+	t->fd = -1;
 }
 
 static void activate_download(Transfer t)
 {
 	TransferInfo d = NEW(TransferInfo);
 
+	d->fd = t->fd;
+	d->tid = t->tid;
 	d->filename = xstrdup(t->filename);
 	d->mode = t->mode;
 	d->offset = t->offset;
 
-	mqueue_send_ptr(hthread_queue(t->thread), HT_DOWNLOAD, d);
+	t->xfer = xfer_download(d);
+	t->fd = -1;
 }
 
-static void initialize_ts(Transfer t)
+static void sequester(Transfer t)
 {
-	struct timeval tv;
+	t->key = ((uintptr_t)++key_generation << KEY_TID_BITS) | t->tid;
+	t->timer = timerwheel_add(ch_timers(t->uid), DATA_CONNECT_TIMEOUT * 1000, sequester_expire, (void *)t->key);
+}
+
+static void unsequester(Transfer t)
+{
+	if(t->timer == NULL)
+		return;
 
-	gettimeofday(&tv, NULL);
-	t->ts.tv_sec = tv.tv_sec + DATA_CONNECT_TIMEOUT;
-	t->ts.tv_nsec = tv.tv_usec * 1000;
+	/* If the timer is already firing it will find the transfer gone, or
+	   no longer sequestered */
+	timerwheel_cancel(t->timer);
+	t->timer = NULL;
 }
 
-static int monitor_add_from_queue()
+static int sequester_from_queue()
 {
-	pthread_t tid;
 	QueueNode n;
 
 	if((n = q_head) == NULL) 
@@ -213,90 +233,97 @@ static int monitor_add_from_queue()
 
 	queue_size--;
 
-	if(n->t->thread != NULL) {
+	if(n->t->fd != -1)
 		activate_download(n->t);
-		xfree(n);
-		return 0;
-	}
-
-	if(seq_head != NULL) {
-		seq_tail->l = n;
-		seq_tail = seq_tail->l;
-		seq_tail->l = NULL;
-	} else {
-		/* If sequester list is empty, start the monitor thread */
-		if(pthread_create(&tid, NULL, monitor_thread, NULL))
-			fatal("Couldn't spawn monitor thread!");
-
-		seq_tail = seq_head = n;
-		seq_tail->l = NULL;
-	}
+	else
+		sequester(n->t);
 
-	initialize_ts(seq_tail->t);
+	xfree(n);
 
 	return 0;
 }
 
-static void *monitor_thread(void *arg)
+/* Unlink a queued download, and move everything behind it up a place */
+static void queue_remove(Transfer t)
 {
-	QueueNode n;
+	QueueNode c, n;
 
+	if(q_head == NULL) {
 #ifdef DEBUG
-	debug("+++ monitor_thread started");
+		debug("!!! INTERNAL INCONSISTENCY in queue_remove(): Transfer marked as queued but queue is empty!");
 #endif
+		return;
+	}
 
-	pthread_mutex_lock(&tfm_lock);
-	while(seq_head != NULL) {
-		if(pthread_cond_timedwait(&tfm_cond, &tfm_lock, &seq_head->t->ts)) {
-			collection_remove(ttbl, seq_head->t->tid);
-
-			if(seq_head->t->type == T_DOWNLOAD) {
-				if(monitor_add_from_queue() < 0)
-					active_downloads--;
-			} else
-				active_uploads--;
+	if(q_head->t == t) {
+		n = q_head;
 
-			transfer_destroy(seq_head->t);
-		} else {
-			if(seq_head->t->type == T_DOWNLOAD)
-				activate_download(seq_head->t);
-			else
-				activate_upload(seq_head->t);
+		if((q_head = q_head->l) == NULL)
+			q_tail = NULL;
+	} else {
+		for(c = q_head; c->l != NULL && c->l->t != t; c = c->l);
+
+		if(c->l == NULL) {
+#ifdef DEBUG
+			debug("!!! INTERNAL INCONSISTENCY in queue_remove(): Transfer marked as queued but not found in queue list!");
+#endif
+			return;
 		}
 
-		n = seq_head;
-		seq_head = seq_head->l;
+		if(c->l == q_tail)
+			q_tail = c;
 
-		xfree(n);
+		n = c->l;
+		c->l = n->l;
 	}
 
-	seq_tail = NULL;
-	pthread_mutex_unlock(&tfm_lock);
+	c = n->l;
+	xfree(n);
+	queue_size--;
 
-#ifdef DEBUG
-	debug("--- monitor thread exiting");
-#endif
+	for(; c != NULL; c = c->l) {
+		c->t->position--;
+		queue_position_notify(c->t->uid, c->t->tid, c->t->position);
+	}
+}
 
-	pthread_exit(NULL);
+/* Give up the slot held by an active or sequestered transfer, handing
+   download slots on to the queue */
+static void release_slot(Transfer t)
+{
+	if(t->type == T_DOWNLOAD) {
+		if(sequester_from_queue() < 0)
+			active_downloads--;
+	} else
+		active_uploads--;
 }
 
-static void monitor_add(Transfer t)
+/* Runs on an event loop once a sequestered transfer has waited too long
+   for its data connection */
+static void sequester_expire(void *arg)
 {
-	pthread_t tid;
+	uintptr_t key = (uintptr_t)arg;
+	Transfer t;
 
-	if(seq_head == NULL) {
-		if(pthread_create(&tid, NULL, monitor_thread, NULL))
-			fatal("Couldn't spawn monitor thread!");
+	pthread_mutex_lock(&tfm_lock);
 
-		seq_head = seq_tail = NEW(QueueNode);
-	} else {
-		seq_tail->l = NEW(QueueNode);
-		seq_tail = seq_tail->l;
+	t = collection_lookup(ttbl, key & ((1 << KEY_TID_BITS) - 1));
+
+	if(t == NULL || t->timer == NULL || t->key != key) {
+		pthread_mutex_unlock(&tfm_lock);
+		return;
 	}
 
-	seq_tail->l = NULL;
-	seq_tail->t = t;
-	initialize_ts(t);
+#ifdef DEBUG
+	debug("Transfer %d timed out waiting for a data connection", t->tid);
+#endif
+	collection_remove(ttbl, t->tid);
+	t->timer = NULL;
+
+	release_slot(t);
+	transfer_destroy(t);
+
+	pthread_mutex_unlock(&tfm_lock);
 }
 
 void tfm_init()
@@ -323,7 +350,7 @@ void tfm_init()
 	if((v = config_int_value("transfers", "max_uploads")) >= 0)
 		max_uploads = v;
 
-	while(active_downloads < max_downloads && !monitor_add_from_queue())
+	while(active_downloads < max_downloads && !sequester_from_queue())
 		active_downloads++;
 
 	pthread_mutex_unlock(&tfm_lock);
@@ -355,7 +382,8 @@ int tfm_add_download(int uid, char *filename, int mode, int offset)
 	t->mode = mode;
 	t->offset = offset;
 	t->fd = -1;
-	t->thread = NULL;
+	t->xfer = NULL;
+	t->timer = NULL;
 
 	if(!enqueue) 
 		t->position = 0;
@@ -365,7 +393,7 @@ int tfm_add_download(int uid, char *filename, int mode, int offset)
 	collection_insert(ttbl, tid, t);
 
 	if(!enqueue) {
-		monitor_add(t);
+		sequester(t);
 		active_downloads++;
 	} else {
 		if(q_head == NULL)  
@@ -436,10 +464,11 @@ int tfm_add_upload(int uid, char *filename, int mode, int offset)
 	t->mode = mode;
 	t->offset = offset;
 	t->fd = -1;
-	t->thread = NULL;
+	t->xfer = NULL;
+	t->timer = NULL;
 
 	collection_insert(ttbl, tid, t);
-	monitor_add(t);
+	sequester(t);
 	active_uploads++;
 
 	ret = tid;
@@ -478,173 +507,85 @@ done:
 	return ret;
 }
 
-int tfm_register(int tid, int fd, uint32_t ip, HThread thread)
+int tfm_register(int tid, int fd, uint32_t ip)
 {
 	int ret = -1;
 	Transfer t;
 	uint32_t real_ip;
-	QueueNode c, n;
 
 	pthread_mutex_lock(&tfm_lock);
 	if((t = collection_lookup(ttbl, tid)) == NULL) 
-		goto done0;
+		goto done;
 
 	if(cm_getval(t->uid, CONN_IP, &real_ip) < 0)
-		goto done0;
+		goto done;
 
 	if(ip != real_ip)
-		goto done0;
+		goto done;
 
-	if(t->thread != NULL)
-		goto done0;
+	if(t->fd != -1 || t->xfer != NULL)
+		goto done;
 
 	t->fd = fd;
-	t->thread = thread;
-
-	/* If download is queued we don't need to worry about anything */
-	if(t->type == T_DOWNLOAD && t->position) 
-		goto done1;
-
-	/* Otherwise  we need to pull it out of the sequester list */
-	if(seq_head == NULL) {
-#ifdef DEBUG
-		debug("!!! INTERNAL INCONSISTENCY in register_download(): Sequester list is empty!");
-#endif
-		goto done0;
-	}
-
-	if(seq_head->t != t) {
-		for(c = seq_head; c->l != NULL && c->t != t; c = c->l);
 
-		if(c->l == NULL) {
-#ifdef DEBUG
-			debug("!!! INTERNAL INCONSISTENCY in register_download(): Transfer missing from sequester list");
-#endif
-			goto done0;
-		}
-
-		n = c->l;
-		c->l = n->l;
-
-		if(c->l == NULL)
-			seq_tail = c;
+	/* If download is queued it's started once it reaches the head of the
+	   queue.  Otherwise it's sequestered, waiting for this connection */
+	if(t->type != T_DOWNLOAD || !t->position) {
+		unsequester(t);
 
 		if(t->type == T_DOWNLOAD)
 			activate_download(t);
 		else
 			activate_upload(t);
+	}
 
-		xfree(n);
-	} else 
-		/* The entry at the head of the sequester list is handled by 
-		   the monitor thread.  We just signal the monitor thread */
-		pthread_cond_signal(&tfm_cond);
-
-done1:
-	t->fd = fd;
-	t->thread = thread;
 	ret = 0;
-done0:
+done:
 	pthread_mutex_unlock(&tfm_lock);
 	return ret;
 }
 
-void tfm_remove(int tid)
+/* Must hold tfm_lock */
+static void transfer_remove(Transfer t)
 {
-	Transfer t;
-	QueueNode c, n;
-
-#ifdef DEBUG
-	debug("tfm_remove() called for TID: %d", tid);
-#endif
-
-	pthread_mutex_lock(&tfm_lock);
-	if((t = collection_remove(ttbl, tid)) == NULL)
-		goto done0;
-
-	if(t->thread == NULL) {
-		if(t->type == T_DOWNLOAD && t->position) {
-			if(q_head == NULL) {
-#ifdef DEBUG
-				debug("!!! INTERNAL INCONSISTENCY in tfm_remove(): Transfer marked as queued but queue is empty!");
-#endif
+	collection_remove(ttbl, t->tid);
 
-				goto done1;
-			} else if(q_head->t == t) {
-				n = q_head;
-				q_head = q_head->l;
-				if((c = q_head) == NULL)
-					q_tail = NULL;
-			} else {
+	if(t->type == T_DOWNLOAD && t->position) 
+		queue_remove(t);
+	else {
+		unsequester(t);
+		release_slot(t);
+	}
 
-				for(c = q_head; c->l != NULL && c->l->t != t; c = c->l);
+	transfer_destroy(t);
+}
 
-				if(c->l == NULL) {
-#ifdef DEBUG
-					debug("!!! INTERNAL INCONSISTENCY in tfm_remove(): Transfer marked as queued but not found in queue list!");
-#endif
+void tfm_complete(int tid, Xfer x)
+{
+	Transfer t;
 
-					goto done1;
-				}
+	pthread_mutex_lock(&tfm_lock);
 
-				if(c->l == q_tail)
-					q_tail = c;
+	/* Unless it was removed while finishing */
+	if((t = collection_lookup(ttbl, tid)) != NULL && t->xfer == x) {
+		t->xfer = NULL;
+		transfer_remove(t);
+	}
 
-				n = c->l;
-				c->l = c->l->l;
-			}
+	pthread_mutex_unlock(&tfm_lock);
+}
 
-			xfree(n);
-			queue_size--;
+void tfm_remove(int tid)
+{
+	Transfer t;
 
-			while(c != NULL) {
-				c->t->position--;
-				queue_position_notify(c->t->uid, c->t->tid, c->t->position);
-				n = n->l;
-			}
-		} else {
-			if(seq_head == NULL) {
 #ifdef DEBUG
-				debug("!!! INTERNAL INCONSISTENCY in tfm_remove(): Sequester list is empty!");
-#endif
-				goto done1; 
-			} else if(seq_head->t == t) 
-				/* Let the monitor thread dispose of the transfer */	
-				goto done0;
-			else {
-				for(c = seq_head; c->l != NULL && c->t != t; c = c->l);
-
-				if(c->l == NULL) {
-#ifdef DEBUG
-					debug("!!! INTERNAL INCONSISTENCY in register_download(): Transfer missing from sequester list");
+	debug("tfm_remove() called for TID: %d", tid);
 #endif
-					goto done1;
-				}
-
-				n = c->l;
-				c->l = n->l;
-				if(c->l == NULL)
-					seq_tail = c;
-
-				xfree(n);
-
-				if(t->type == T_DOWNLOAD) {
-					if(monitor_add_from_queue() < 0)
-						active_downloads--;
-				} else
-					active_uploads--;
-			}
-		}
-	} else {
-		if(t->type == T_DOWNLOAD) {
-			if(monitor_add_from_queue() < 0)
-				active_downloads--;
-		} else
-			active_uploads--;
-	}
-done1:
-	transfer_destroy(t);
-done0:
+
+	pthread_mutex_lock(&tfm_lock);
+	if((t = collection_lookup(ttbl, tid)) != NULL)
+		transfer_remove(t);
 	pthread_mutex_unlock(&tfm_lock);
 }
 
@@ -695,7 +636,7 @@ void tfm_purge_uid(int uid)
 		n = c;
 		c = c->l;
 
-		t = collection_remove(ttbl, n->t->uid);
+		t = collection_remove(ttbl, n->t->tid);
 		xfree(n);
 
 		if(t == NULL) {
@@ -708,11 +649,16 @@ void tfm_purge_uid(int uid)
 #ifdef DEBUG
 		debug("Purging transfer with TID: %d", t->tid);
 #endif
-		if(t->type == T_DOWNLOAD) {
-			if(t->position == 0)
+		if(t->type == T_DOWNLOAD && t->position)
+			queue_remove(t);
+		else {
+			unsequester(t);
+
+			if(t->type == T_DOWNLOAD)
 				active_downloads--;
-		} else
-			active_uploads--;
+			else
+				active_uploads--;
+		}
 
 		transfer_destroy(t);
 	}
@@ -721,7 +667,7 @@ void tfm_purge_uid(int uid)
 	debug("Finished purging transfers for %d", uid);
 #endif
 
-	while(active_downloads < max_downloads && !monitor_add_from_queue())
+	while(active_downloads < max_downloads && !sequester_from_queue())
 		active_downloads++;
 
 	pthread_mutex_unlock(&tfm_lock);
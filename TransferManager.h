@@ -2,14 +2,21 @@
 #define TRANSFER_MANAGER_H
 
 #include <global.h>
-#include <HThread.h>
+#include <transfer_handler.h>
 
 void tfm_init();
 void tfm_destroy();
 
 int tfm_add_download(int uid, char *filename, int mode, int offset);
 int tfm_add_upload(int uid, char *filename, int mode, int offset);
-int tfm_register(int tid, int fd, uint32_t ip, HThread t);
+
+/* Attach a data connection to a transfer.  It's handed to the transfer
+   engine once the transfer is activated, and closed with the transfer
+   until then */
+int tfm_register(int tid, int fd, uint32_t ip);
+
+/* Called by transfer x once it's done with its slot */
+void tfm_complete(int tid, Xfer x);
 
 int tfm_position(int tid);
 int tfm_owner(int tid);
@@ -0,0 +1,252 @@
+#include <global.h>
+
+#include <pthread.h>
+
+#include <Collection.h>
+#include <Config.h>
+#include <ConnectionManager.h>
+#include <ThreadManager.h>
+#include <admission.h>
+#include <atomic.h>
+#include <log.h>
+#include <util.h>
+#include <xmalloc.h>
+
+/* What we remember about an address */
+typedef struct _Source {
+	int connections;
+
+	/* Accept tokens, in thousandths, and when they were last topped up */
+	uint64_t tokens;
+	uint64_t refilled;
+} *Source;
+
+/* Why a connection was turned away */
+enum {
+	SHED_TOTAL,
+	SHED_PER_IP,
+	SHED_RATE,
+	SHED_LOAD,
+	SHED_REASONS
+};
+
+/* Under adm_lock.  Addresses are only tracked while there's a limit per
+   address */
+static Collection sources = NULL;
+static int connections = 0;
+static pthread_mutex_t adm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int max_connections = 0, max_per_ip = 0;
+static int accept_rate = 0, accept_burst = 0;
+static int shed_queue_depth = 0, shed_output_bytes = 0;
+
+/* Connections turned away since the last report, and in all */
+static unsigned long shed[SHED_REASONS];
+static unsigned long shed_total = 0;
+
+/* Set while we're turning everyone away */
+static int overloaded = 0;
+
+static int adm_int_value(char *var)
+{
+	int v;
+
+	if((v = config_int_value("global", var)) < 0)
+		return 0;
+
+	return v;
+}
+
+void adm_init()
+{
+	pthread_mutex_lock(&adm_lock);
+
+	if(sources == NULL)
+		sources = collection_create();
+
+	max_connections = adm_int_value("max_connections");
+	max_per_ip = adm_int_value("max_connections_per_ip");
+	accept_rate = adm_int_value("accept_rate");
+
+	if((accept_burst = adm_int_value("accept_burst")) < 1)
+		accept_burst = accept_rate > 0 ? accept_rate : 1;
+
+	shed_queue_depth = adm_int_value("shed_queue_depth");
+	shed_output_bytes = adm_int_value("shed_output_bytes");
+
+	pthread_mutex_unlock(&adm_lock);
+}
+
+/* Whether the server is too busy to take anyone else on.  Logs as that
+   starts and stops being so */
+static int adm_overloaded()
+{
+	int busy;
+
+	busy = (shed_queue_depth > 0 && tm_queued() > shed_queue_depth) ||
+		(shed_output_bytes > 0 && cm_output_bytes() > shed_output_bytes);
+
+	if(busy != ATOMIC_LOAD(&overloaded) && ATOMIC_XCHG(&overloaded, busy) != busy) {
+		if(busy)
+			log("!!! Warning: Server overloaded, turning away new connections");
+		else
+			log("*** Server load back under limits, taking new connections");
+	}
+
+	return busy;
+}
+
+/* Top up s's tokens for the time since they last were */
+static void adm_refill(Source s, uint64_t now)
+{
+	s->tokens += (now - s->refilled) * accept_rate;
+	s->refilled = now;
+
+	if(s->tokens > (uint64_t)accept_burst * 1000)
+		s->tokens = (uint64_t)accept_burst * 1000;
+}
+
+int adm_admit(uint32_t ip)
+{
+	Source s = NULL;
+	int reason;
+
+	/* Checked first, since it takes no lock */
+	if(adm_overloaded()) {
+		reason = SHED_LOAD;
+		goto shed;
+	}
+
+	pthread_mutex_lock(&adm_lock);
+
+	if(max_connections > 0 && connections >= max_connections) {
+		pthread_mutex_unlock(&adm_lock);
+
+		reason = SHED_TOTAL;
+		goto shed;
+	}
+
+	if((max_per_ip > 0 || accept_rate > 0) && (s = collection_lookup(sources, ip)) == NULL) {
+		s = NEW(Source);
+		s->connections = 0;
+		s->tokens = (uint64_t)accept_burst * 1000;
+		s->refilled = now_msec();
+
+		collection_insert(sources, ip, s);
+	}
+
+	if(max_per_ip > 0 && s->connections >= max_per_ip) {
+		pthread_mutex_unlock(&adm_lock);
+
+		reason = SHED_PER_IP;
+		goto shed;
+	}
+
+	if(accept_rate > 0) {
+		adm_refill(s, now_msec());
+
+		if(s->tokens < 1000) {
+			pthread_mutex_unlock(&adm_lock);
+
+			reason = SHED_RATE;
+			goto shed;
+		}
+
+		s->tokens -= 1000;
+	}
+
+	if(s != NULL)
+		s->connections++;
+	connections++;
+
+	pthread_mutex_unlock(&adm_lock);
+
+	return 1;
+
+shed:
+	ATOMIC_ADD(&shed[reason], 1);
+	return 0;
+}
+
+void adm_release(uint32_t ip)
+{
+	Source s;
+
+	pthread_mutex_lock(&adm_lock);
+
+	if(connections > 0)
+		connections--;
+
+	/* Addresses may have started being tracked since this one connected */
+	if((s = collection_lookup(sources, ip)) != NULL && s->connections > 0)
+		s->connections--;
+
+	pthread_mutex_unlock(&adm_lock);
+}
+
+/* Addresses which are no longer connected, and whose buckets have filled
+   back up */
+struct adm_sweep {
+	uint64_t now;
+
+	CollectionKey *keys;
+	int count, size;
+};
+
+static int adm_sweep_source(CollectionKey key, void *data, void *ptr)
+{
+	Source s = (Source)data;
+	struct adm_sweep *w = (struct adm_sweep *)ptr;
+
+	if(s->connections > 0)
+		return 1;
+
+	if(accept_rate > 0) {
+		adm_refill(s, w->now);
+
+		if(s->tokens < (uint64_t)accept_burst * 1000)
+			return 1;
+	}
+
+	if(w->count == w->size) {
+		w->size = w->size ? w->size * 2 : 64;
+		w->keys = (CollectionKey *)xrealloc(w->keys, sizeof(CollectionKey) * w->size);
+	}
+
+	w->keys[w->count++] = key;
+
+	return 1;
+}
+
+void adm_report()
+{
+	unsigned long n[SHED_REASONS], total = 0;
+	struct adm_sweep w;
+	int i;
+
+	for(i = 0; i < SHED_REASONS; i++)
+		total += (n[i] = ATOMIC_XCHG(&shed[i], 0));
+
+	if(total > 0) {
+		shed_total += total;
+
+		log("*** Turned away %lu connections in the last %d seconds (%lu in all): %lu at max_connections, %lu at max_connections_per_ip, %lu over accept_rate, %lu overloaded",
+			total, ADM_REPORT_INTERVAL, shed_total, n[SHED_TOTAL], n[SHED_PER_IP], n[SHED_RATE], n[SHED_LOAD]);
+	}
+
+	w.now = now_msec();
+	w.keys = NULL;
+	w.count = w.size = 0;
+
+	pthread_mutex_lock(&adm_lock);
+
+	collection_iterate(sources, adm_sweep_source, &w);
+
+	for(i = 0; i < w.count; i++)
+		xfree(collection_remove(sources, w.keys[i]));
+
+	pthread_mutex_unlock(&adm_lock);
+
+	if(w.keys != NULL)
+		xfree(w.keys);
+}
@@ -0,0 +1,32 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+/* Admission control for control connections.  Each one is checked as it's
+   accepted, before anything is allocated for it, against:
+
+   - global::max_connections, and global::max_connections_per_ip
+   - a token bucket per address, refilled at global::accept_rate
+     connections per second up to global::accept_burst
+   - the load on the server: once more than global::shed_queue_depth jobs
+     are waiting for helpers, or more than global::shed_output_bytes are
+     queued for clients, every new connection is turned away
+
+   Anything left at 0 isn't limited.  Connections turned away are counted,
+   and reported every ADM_REPORT_INTERVAL seconds if there were any */
+
+#include <global.h>
+
+#define ADM_REPORT_INTERVAL	60
+
+void adm_init();
+
+/* Returns 1 if a connection from ip may be taken, which is then counted
+   until adm_release() is called for it, or 0 if it should be closed */
+int adm_admit(uint32_t ip);
+void adm_release(uint32_t ip);
+
+/* Log how many connections have been turned away since the last report,
+   and forget about addresses with nothing left to remember */
+void adm_report();
+
+#endif
@@ -0,0 +1,40 @@
+/* Atomic operations
+
+   Thin wrappers around the compiler's atomic builtins.  Loads have acquire
+   semantics and stores have release semantics; everything else is fully
+   sequentially consistent.  ATOMIC_LOAD_SC is a sequentially consistent
+   load, for when a thread writes one variable then reads another, and
+   has to be ordered against a thread doing the opposite.  ATOMIC_CAS takes a pointer to the expected
+   value, which is updated with the current value when the swap fails.
+*/
+
+#ifndef ATOMIC_H
+#define ATOMIC_H
+
+#if defined(__ATOMIC_SEQ_CST)
+
+#define ATOMIC_LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_LOAD_SC(p)	__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_XCHG(p, v)	__atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_CAS(p, o, n)	__atomic_compare_exchange_n((p), (o), (n), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define ATOMIC_ADD(p, v)	__atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_SUB(p, v)	__atomic_sub_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_FENCE()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#else
+
+/* Older compilers only have the __sync builtins, which are all full
+   barriers */
+#define ATOMIC_LOAD(p)		(__sync_synchronize(), *(volatile __typeof__(*(p)) *)(p))
+#define ATOMIC_LOAD_SC(p)	ATOMIC_LOAD(p)
+#define ATOMIC_STORE(p, v)	do { __sync_synchronize(); *(volatile __typeof__(*(p)) *)(p) = (v); __sync_synchronize(); } while(0)
+#define ATOMIC_XCHG(p, v)	(__sync_synchronize(), __sync_lock_test_and_set((p), (v)))
+#define ATOMIC_CAS(p, o, n)	({ __typeof__(*(p)) _e = *(o), _v = __sync_val_compare_and_swap((p), _e, (n)); *(o) = _v; _v == _e; })
+#define ATOMIC_ADD(p, v)	__sync_add_and_fetch((p), (v))
+#define ATOMIC_SUB(p, v)	__sync_sub_and_fetch((p), (v))
+#define ATOMIC_FENCE()		__sync_synchronize()
+
+#endif
+
+#endif
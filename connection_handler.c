@@ -4,27 +4,151 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
+#include <Collection.h>
 #include <Config.h>
 #include <ConnectionManager.h>
-#include <HThread.h>
+#include <CpuSet.h>
 #include <Multiplexer.h>
 #include <ThreadManager.h>
+#include <TimerWheel.h>
+#include <admission.h>
 #include <connection_handler.h>
-#include <helper_thread.h>
 #include <listener.h>
 #include <log.h>
 #include <output.h>
+#include <transfer_handler.h>
 #include <util.h>
 #include <xmalloc.h>
 
+/* Largest number of events handled per trip through the multiplexer */
+#define EVENT_BATCH	64
+
+/* The client opens with "TRTPHOTL" and two 16-bit version numbers */
+#define HELLO_SIZE	12
+
+/* Each event loop has its own multiplexer and its own listeners, and owns
+   the control connections it accepts.  With more than one loop the
+   listeners share their ports through SO_REUSEPORT, and the kernel spreads
+   incoming connections across them.
+
+   Each loop also drives a timer wheel, performs the handshake on the
+   control connections it accepts, and flushes their output queues.  Data
+   connections are handed straight to the transfer engine */
+typedef struct _EventLoop {
+	Multiplexer m;
+	int control_socket, data_socket;
+
+	TimerWheel timers;
+
+	/* Control connections still in their handshake.  Only touched by
+	   the loop's own thread */
+	Collection handshakes;
+
+	pthread_t tid;
+} *EventLoop;
+
+/* Handshake in progress on a control connection */
+typedef struct _Handshake {
+	struct _EventLoop *l;
+	int fd;
+
+	uint8_t buf[HELLO_SIZE];
+	int len;
+
+	Timer timer;
+} *Handshake;
+
+static EventLoop loops = NULL;
+static int loop_count = 0;
+
+/* CPUs the loops are bound to, one each */
+static CpuSet loop_cpus = NULL;
+
 static uint32_t listen_address = 0;
-static int control_socket = -1, data_socket = -1, listen_port = -1;
+static int listen_port = -1, listen_backlog = -1, accept_batch = DEFAULT_ACCEPT_BATCH;
+static mmode_t client_mode = MPLX_ONESHOT;
+
+static void ch_wakeup(void *ptr)
+{
+	multiplexer_wakeup((Multiplexer)ptr);
+}
+
+static void ch_admission_report(void *arg)
+{
+	adm_report();
+	timerwheel_add(loops[0].timers, ADM_REPORT_INTERVAL * 1000, ch_admission_report, NULL);
+}
+
+static void ch_create_loops()
+{
+	int i;
+
+	if((loop_count = config_int_value("threads", "event_loops")) < 1)
+		loop_count = DEFAULT_EVENT_LOOPS;
+
+#ifndef SO_REUSEPORT
+	if(loop_count > 1) {
+		log("!!! Warning: SO_REUSEPORT unsupported, using a single event loop");
+		loop_count = 1;
+	}
+#endif
+
+	loops = NEWV(EventLoop, loop_count);
+	loop_cpus = cpuset_config("event_loop_cpus");
+
+	for(i = 0; i < loop_count; i++) {
+		loops[i].m = multiplexer_create();
+		loops[i].control_socket = loops[i].data_socket = -1;
+
+		loops[i].timers = timerwheel_create(ch_wakeup, loops[i].m);
+		loops[i].handshakes = collection_create();
+	}
+
+	if(loop_count > 1)
+		log("*** Running %d event loops", loop_count);
+
+	timerwheel_add(loops[0].timers, ADM_REPORT_INTERVAL * 1000, ch_admission_report, NULL);
+}
+
+static void ch_listen(EventLoop l, uint32_t source_address, int port)
+{
+	char *t;
+
+	if(l->control_socket != -1) {
+		multiplexer_remove(l->m, l->control_socket, MPLX_RD);
+		close(l->control_socket);
+	}
+
+	if(l->data_socket != -1) {
+		multiplexer_remove(l->m, l->data_socket, MPLX_RD);
+		close(l->data_socket);
+	}
+
+	if((l->control_socket = listener_create(source_address, port, loop_count > 1, listen_backlog)) < 0) {
+		log("!!! Warning: Couldn't bind control socket to %s:%d", t = xinet_ntoa(source_address), port);
+		xfree(t);
+
+		fatal("!!! Couldn't create a listener socket - fix your configuration and restart!");
+	} else 
+		multiplexer_add(l->m, l->control_socket, MPLX_RD);
+
+	if((l->data_socket = listener_create(source_address, port + 1, loop_count > 1, listen_backlog)) < 0) {
+		log("!!! Warning: Couldn't bind data socket to %s:%d", t = xinet_ntoa(source_address), port);
+		xfree(t);
+
+		fatal("!!! Couldn't create a listener socket - fix your configuration and restart!");
+	} else
+		multiplexer_add(l->m, l->data_socket, MPLX_RD);
+}
 
 void ch_init()
 {
 	uint32_t source_address;
-	int port;
+	int i, port, backlog;
 	char *t;
 
 	if((t = config_value("global", "listen_address")) != NULL) {
@@ -36,107 +160,261 @@ void ch_init()
 	if((port = config_int_value("global", "port")) < 0)
 		port = HL_DEFAULT_PORT;
 
-	if(listen_address != source_address || listen_port != port) {
+	if((backlog = config_int_value("global", "listen_backlog")) < 1)
+		backlog = DEFAULT_LISTEN_BACKLOG;
+
+	if((accept_batch = config_int_value("global", "accept_batch")) < 1)
+		accept_batch = DEFAULT_ACCEPT_BATCH;
+
+	/* Listeners are always level triggered, since a batch of at most
+	   accept_batch connections may leave more in the backlog, which must
+	   be reported again.  Client connections may be edge triggered, and
+	   are one-shot so they're disarmed while a helper thread owns them */
+	if(config_truth_value("global", "edge_triggered") == 1)
+		client_mode = MPLX_EDGE | MPLX_ONESHOT;
+	else
+		client_mode = MPLX_LEVEL | MPLX_ONESHOT;
+
+	/* The number of event loops is fixed once the server is running */
+	if(loops == NULL)
+		ch_create_loops();
+
+	if(listen_address != source_address || listen_port != port || listen_backlog != backlog) {
 		listen_address = source_address;
 		listen_port = port;
+		listen_backlog = backlog;
 
-		if(control_socket != -1) {
-			multiplexer_remove(control_socket, MPLX_RD);
-			close(control_socket);
-		}
+		for(i = 0; i < loop_count; i++)
+			ch_listen(&loops[i], source_address, port);
 
-		if(data_socket != -1) {
-			multiplexer_remove(data_socket, MPLX_RD);
-			close(data_socket);
-		}
+		log("*** Listening on %s:%d", t = xinet_ntoa(source_address), port);
+		xfree(t);
+	}
+}
 
-		if((control_socket = listener_create(source_address, port)) < 0) {
-			log("!!! Warning: Couldn't bind control socket to %s:%d", t = xinet_ntoa(source_address), port);
-			xfree(t);
+/* Resume watching a control connection after its transaction is handled */
+void ch_rearm(int fd)
+{
+	cm_input_rearm(fd);
+}
 
-			fatal("!!! Couldn't create a listener socket - fix your configuration and restart!");
-		} else {
-			multiplexer_add(control_socket, MPLX_RD);
-			log("*** Listening on %s:%d", t = xinet_ntoa(source_address), port);
-			xfree(t);
-		}
+/* Timer wheel of the event loop which owns a control connection, or of the
+   first loop if there's no such connection */
+TimerWheel ch_timers(int fd)
+{
+	Multiplexer m;
+	int i;
 
-		if((data_socket = listener_create(source_address, port + 1)) < 0) {
-			log("!!! Warning: Couldn't bind data socket to %s:%d", t = xinet_ntoa(source_address), port);
-			xfree(t);
+	if((m = cm_get_multiplexer(fd)) != NULL)
+		for(i = 0; i < loop_count; i++)
+			if(loops[i].m == m)
+				return loops[i].timers;
 
-			fatal("!!! Couldn't create a listener socket - fix your configuration and restart!");
-		} else
-			multiplexer_add(data_socket, MPLX_RD);
-	}
+	return loops[0].timers;
 }
 
-static void ch_accept_control_connection(int fd)
+static void ch_handshake_finish(Handshake h, int ok)
 {
-	int cfd;
-	uint32_t ip;
+	EventLoop l = h->l;
 	char *s;
 
-	if((cfd = listener_accept(fd, &ip)) < 0)
-		return;
+	collection_remove(l->handshakes, h->fd);
 
-	cm_add(cfd, ip);
+	/* Fails harmlessly if we were called by the timer itself */
+	timerwheel_cancel(h->timer);
 
-	log("+++ Connect: %s on control port (%d)", (s = xinet_ntoa(ip)), cfd);
-	xfree(s);
+	if(ok) {
+		log("+++ Connect: %s on control port (%d)", s = conn_ntoa(h->fd), h->fd);
+		xfree(s);
 
-	mqueue_send_int(hthread_queue(tm_get_thread()), HT_CONTROL_CONNECT, cfd);
+		/* From here on the connection is watched for transactions */
+		multiplexer_rearm(l->m, h->fd, MPLX_RD);
+	} else if(cm_get_multiplexer(h->fd) == l->m) {
+		/* Unless somebody else already disconnected it, and its
+		   descriptor went to a connection on another loop */
+		log("--- Disconnect: %s (%d) failed handshake", s = conn_ntoa(h->fd), h->fd);
+		xfree(s);
+
+		cm_remove(h->fd);
+	}
+
+	xfree(h);
 }
 
-static void ch_accept_data_connection(int fd)
+static void ch_handshake_expire(void *arg)
 {
-	ConnectionInfo c;
-	char *s;
+	ch_handshake_finish((Handshake)arg, 0);
+}
+
+/* Read as much of the hello as has arrived, without blocking */
+static void ch_handshake(Handshake h)
+{
+	ssize_t r;
+
+	while(h->len < HELLO_SIZE) {
+		if((r = recv(h->fd, h->buf + h->len, HELLO_SIZE - h->len, 0)) > 0) {
+			h->len += r;
+			continue;
+		}
+
+		if(r < 0 && errno == EINTR)
+			continue;
+
+		if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			multiplexer_rearm(h->l->m, h->fd, MPLX_RD);
+			return;
+		}
+
+		ch_handshake_finish(h, 0);
+		return;
+	}
 
-	c = NEW(ConnectionInfo);
-	
-	if((c->fd = listener_accept(fd, &c->ip)) < 0) {
-		xfree(c);
+	/* The reply always fits in a fresh socket's send buffer */
+	if(memcmp(h->buf, "TRTPHOTL", 8) || send(h->fd, "TRTP\0\0\0\0", 8, 0) != 8) {
+		ch_handshake_finish(h, 0);
 		return;
 	}
 
-	log("+++ Connect: %s on data port (%d)", (s = xinet_ntoa(c->ip)), c->fd);
-	xfree(s);
+	ch_handshake_finish(h, 1);
+}
+
+static void ch_handshake_begin(EventLoop l, int fd)
+{
+	Handshake h;
+
+	/* A stale entry means the last connection with this descriptor was
+	   disconnected from elsewhere before finishing its handshake */
+	if((h = collection_remove(l->handshakes, fd)) != NULL) {
+		timerwheel_cancel(h->timer);
+		xfree(h);
+	}
+
+	h = NEW(Handshake);
+	h->l = l;
+	h->fd = fd;
+	h->len = 0;
+	h->timer = timerwheel_add(l->timers, RESPONSE_TIMEOUT * 1000, ch_handshake_expire, h);
 
-	mqueue_send_ptr(hthread_queue(tm_get_thread()), HT_DATA_CONNECT, c);
+	collection_insert(l->handshakes, fd, h);
+	multiplexer_add_mode(l->m, fd, MPLX_RD, client_mode);
+}
+
+/* Drain up to accept_batch connections from the backlog.  No thread is
+   involved until the handshake is done and a transaction has arrived, and
+   nothing at all for connections admission control turns away */
+static void ch_accept_control_connection(EventLoop l, int fd)
+{
+	int i, cfd;
+	uint32_t ip;
+
+	for(i = 0; i < accept_batch; i++) {
+		if((cfd = listener_accept(fd, &ip)) < 0)
+			return;
+
+		if(!adm_admit(ip)) {
+			listener_reject(cfd);
+			continue;
+		}
+
+		cm_add(cfd, ip, l->m);
+		ch_handshake_begin(l, cfd);
+	}
+}
+
+static void ch_accept_data_connection(EventLoop l, int fd)
+{
+	int i, cfd;
+	uint32_t ip;
+
+	for(i = 0; i < accept_batch; i++) {
+		if((cfd = listener_accept(fd, &ip)) < 0)
+			return;
+
+		xfer_accept(cfd, ip);
+	}
 }
 
 static void ch_handle_transaction(int fd)
 {
-	mqueue_send_int(hthread_queue(tm_get_thread()), HT_TRANSACTION, fd);
+	tm_dispatch_uid(TM_CLASS_CHAT, HT_TRANSACTION, fd);
 }
 
-void ch_main()
+static void *ch_loop(void *loop)
 {
-	int fd;
+	EventLoop l = (EventLoop)loop;
+	struct mevent ev[EVENT_BATCH];
+	int i, n, fd;
+	Handshake h;
+
+	if((n = cpuset_bind(loop_cpus, l - loops)) >= 0)
+		log("*** Event loop %d bound to CPU %d", (int)(l - loops), n);
 
 	for(;;) {
-		if(multiplexer_poll(&fd, NULL)) {
+		n = multiplexer_poll_many(l->m, ev, EVENT_BATCH, timerwheel_next(l->timers));
+		timerwheel_run(l->timers);
+
+		if(n < 1) {
 #ifdef DEBUG
 			debug("*** connection handler: notifier activated");
 #endif
 			continue;
 		}
 
-		if(fd == control_socket) {
-			ch_accept_control_connection(fd);
-			continue;
-		}
+		for(i = 0; i < n; i++) {
+			fd = ev[i].fd;
 
-		if(fd == data_socket) {
-			ch_accept_data_connection(fd);
-			continue;
-		}
+			if(fd == l->control_socket) {
+				ch_accept_control_connection(l, fd);
+				continue;
+			}
+
+			if(fd == l->data_socket) {
+				ch_accept_data_connection(l, fd);
+				continue;
+			}
 
+			/* A control connection with output queued has become
+			   writable */
+			if(ev[i].event == MPLX_WR) {
+				cm_output_flush(fd);
+				continue;
+			}
+
+			if((h = collection_lookup(l->handshakes, fd)) != NULL) {
+				ch_handshake(h);
+				continue;
+			}
+
+			/* Keep reading until a whole transaction is here.  The
+			   descriptor was disarmed when it was reported, so
+			   nothing else will be dispatched for it until the
+			   helper rearms it */
+			switch(cm_input_fill(fd)) {
+				case 0:
+					ch_rearm(fd);
+					break;
+				case 1:
 #ifdef DEBUG
-		debug("*** Transaction received");
+					debug("*** Transaction received");
 #endif
-		multiplexer_remove(fd, MPLX_RD);
-		ch_handle_transaction(fd);
+					ch_handle_transaction(fd);
+					break;
+			}
+		}
 	}
+
+	return NULL;
+}
+
+void ch_main()
+{
+	int i;
+
+	for(i = 1; i < loop_count; i++)
+		if(pthread_create(&loops[i].tid, NULL, ch_loop, &loops[i]))
+			fatal("!!! Fatal error: Couldn't start event loop thread");
+
+	/* The first loop runs in the main thread */
+	loops[0].tid = pthread_self();
+	ch_loop(&loops[0]);
 }
@@ -1,7 +1,12 @@
 #ifndef CONNECTION_HANDLER_H
 #define CONNECTION_HANDLER_H
 
+#include <TimerWheel.h>
+
 void ch_init();
 void ch_main();
+void ch_rearm(int fd);
+
+TimerWheel ch_timers(int fd);
 
 #endif
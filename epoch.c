@@ -0,0 +1,190 @@
+/*
+   epoch.c: Epoch based reclamation
+
+   There's a global epoch, and every thread which has ever read has a record
+   of the epoch it's reading in, if it's reading at all.  Something retired
+   during epoch e was unlinked before then, so readers who entered in e + 1
+   or later can't see it.  The epoch only moves on once every reader has
+   caught up with it, so by the time it reaches e + 2 nobody is left who
+   could, and it's freed.
+*/
+
+#include <global.h>
+
+#include <pthread.h>
+
+#include <atomic.h>
+#include <epoch.h>
+#include <xmalloc.h>
+
+/* Set in a record's epoch while its thread is reading */
+#define EPOCH_ACTIVE	1UL
+
+/* Retired objects held before trying to move the epoch on */
+#define EPOCH_BATCH	16
+
+typedef struct _EpochRecord {
+	/* The epoch read in, shifted up past EPOCH_ACTIVE, or 0 */
+	unsigned long epoch;
+
+	/* How deep the thread's epoch_enter() calls are nested.  Only
+	   touched by its own thread */
+	int depth;
+
+	/* Set while a thread owns the record.  Records are never freed, but
+	   are handed on once their thread exits */
+	int used;
+
+	struct _EpochRecord *next;
+} *EpochRecord;
+
+typedef struct _EpochGarbage {
+	void *ptr;
+	void (*free_func)(void *);
+
+	unsigned long epoch;
+	struct _EpochGarbage *next;
+} *EpochGarbage;
+
+static unsigned long global_epoch = 1;
+
+/* Only ever pushed onto, so it can be walked without a lock */
+static EpochRecord records = NULL;
+
+static pthread_key_t record_key;
+static pthread_once_t record_once = PTHREAD_ONCE_INIT;
+
+/* Under garbage_lock, oldest last */
+static EpochGarbage garbage = NULL;
+static int garbage_count = 0;
+static pthread_mutex_t garbage_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void epoch_record_release(void *ptr)
+{
+	EpochRecord r = (EpochRecord)ptr;
+
+	ATOMIC_STORE(&r->epoch, 0);
+	ATOMIC_STORE(&r->used, 0);
+}
+
+static void epoch_once_init(void)
+{
+	pthread_key_create(&record_key, epoch_record_release);
+}
+
+static EpochRecord epoch_record()
+{
+	EpochRecord r;
+	int unused;
+
+	if((r = (EpochRecord)pthread_getspecific(record_key)) != NULL)
+		return r;
+
+	/* Take over the record of a thread which has exited, if there is one */
+	for(r = ATOMIC_LOAD(&records); r != NULL; r = r->next) {
+		unused = 0;
+
+		if(ATOMIC_LOAD(&r->used) == 0 && ATOMIC_CAS(&r->used, &unused, 1))
+			break;
+	}
+
+	if(r == NULL) {
+		r = NEW(EpochRecord);
+		r->epoch = 0;
+		r->used = 1;
+		r->next = ATOMIC_LOAD(&records);
+
+		while(!ATOMIC_CAS(&records, &r->next, r));
+	}
+
+	r->depth = 0;
+	pthread_setspecific(record_key, r);
+
+	return r;
+}
+
+void epoch_enter()
+{
+	EpochRecord r;
+
+	pthread_once(&record_once, epoch_once_init);
+	r = epoch_record();
+
+	/* Sequentially consistent, so a writer moving the epoch on either sees
+	   us here, or made its changes before we start reading */
+	if(r->depth++ == 0)
+		ATOMIC_XCHG(&r->epoch, (ATOMIC_LOAD(&global_epoch) << 1) | EPOCH_ACTIVE);
+}
+
+void epoch_exit()
+{
+	EpochRecord r = (EpochRecord)pthread_getspecific(record_key);
+
+	if(--r->depth == 0)
+		ATOMIC_STORE(&r->epoch, 0);
+}
+
+/* Move the epoch on if every reader has caught up with it.  Called with
+   garbage_lock held, which keeps writers from moving it at once */
+static void epoch_advance()
+{
+	EpochRecord r;
+	unsigned long e, current;
+
+	current = ATOMIC_LOAD(&global_epoch);
+
+	for(r = ATOMIC_LOAD(&records); r != NULL; r = r->next) {
+		e = ATOMIC_LOAD(&r->epoch);
+
+		if((e & EPOCH_ACTIVE) && (e >> 1) != current)
+			return;
+	}
+
+	ATOMIC_XCHG(&global_epoch, current + 1);
+}
+
+void epoch_retire(void *ptr, void (*free_func)(void *))
+{
+	EpochGarbage g, *p, reclaimed = NULL;
+	unsigned long current;
+
+	pthread_once(&record_once, epoch_once_init);
+
+	g = NEW(EpochGarbage);
+	g->ptr = ptr;
+	g->free_func = free_func;
+
+	pthread_mutex_lock(&garbage_lock);
+
+	g->epoch = ATOMIC_LOAD(&global_epoch);
+	g->next = garbage;
+	garbage = g;
+
+	if(++garbage_count < EPOCH_BATCH) {
+		pthread_mutex_unlock(&garbage_lock);
+		return;
+	}
+
+	epoch_advance();
+	current = ATOMIC_LOAD(&global_epoch);
+
+	/* Everything from two epochs back is out of reach */
+	for(p = &garbage; *p != NULL; p = &(*p)->next)
+		if((*p)->epoch + 2 <= current) {
+			reclaimed = *p;
+			*p = NULL;
+			break;
+		}
+
+	for(g = reclaimed; g != NULL; g = g->next)
+		garbage_count--;
+
+	pthread_mutex_unlock(&garbage_lock);
+
+	while((g = reclaimed) != NULL) {
+		reclaimed = g->next;
+
+		g->free_func(g->ptr);
+		xfree(g);
+	}
+}
@@ -0,0 +1,23 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/* Epoch based reclamation
+
+   Lets readers walk shared structures without taking any lock.  A reader
+   brackets its walk with epoch_enter() and epoch_exit(), and anything it
+   can reach from inside stays allocated until it's left.  A writer unlinks
+   an object so no new reader can find it, then hands it to
+   epoch_retire(), which frees it once every reader which might still see
+   it has left.
+
+   Readers mustn't block for long between entering and leaving, since
+   nothing retired meanwhile can be freed.  Entering again from inside is
+   allowed, and only the outermost exit counts */
+
+void epoch_enter(void);
+void epoch_exit(void);
+
+/* Free ptr with free_func after every current reader has left */
+void epoch_retire(void *ptr, void (*free_func)(void *));
+
+#endif
@@ -15,9 +15,34 @@
 /* Default port to bind to */
 #define HL_DEFAULT_PORT         5500
 
+/* Length of the listeners' pending connection queues */
+#define DEFAULT_LISTEN_BACKLOG	1024
+
+/* Most connections accepted from a listener per multiplexer event */
+#define DEFAULT_ACCEPT_BATCH	64
+
 /* Limits for the thread pool */
 #define DEFAULT_MAX_ACTIVE_THREADS      128
-#define DEFAULT_MAX_INACTIVE_THREADS    8
+#define DEFAULT_WORKERS                 8
+#define DEFAULT_STEAL_THRESHOLD         4
+#define DEFAULT_FILE_WORKERS            4
+#define DEFAULT_FILE_MAX_THREADS        64
+
+/* Sizing of the thread pools under changing load */
+#define DEFAULT_SPARE_WORKERS		2
+#define DEFAULT_IDLE_TIMEOUT		30
+#define DEFAULT_LATENCY_TARGET		20
+#define DEFAULT_STACK_SIZE		256
+#define DEFAULT_COROUTINE_STACK		64
+
+/* Number of connection handler threads */
+#define DEFAULT_EVENT_LOOPS		1
+
+/* Number of transfer engine threads */
+#define DEFAULT_XFER_THREADS		2
+
+/* Bytes queued for a client before the slow_clients policy applies */
+#define DEFAULT_OUTPUT_HIGH_WATERMARK	65536
 
 /* Version the server is supposedly emulating (in this case, 1.8.5) */
 #define SERVER_VERSION  	185
@@ -35,4 +60,7 @@
 /* Maximum length of a chat message */
 #define MAX_CHAT_MESSAGE_LEN	512
 
+/* Maximum length of a nickname.  Longer ones are cut short */
+#define MAX_NICKNAME_LEN	255
+
 #endif
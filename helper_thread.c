@@ -1,189 +1,259 @@
 #include <global.h>
-#include <arpa/inet.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 
+#include <Config.h>
 #include <ConnectionManager.h>
+#include <Coroutine.h>
 #include <HThread.h>
-#include <MQueue.h>
-#include <Multiplexer.h>
 #include <ThreadManager.h>
 #include <TransferManager.h>
 #include <Transaction.h>
+#include <connection_handler.h>
 #include <log.h>
 #include <helper_thread.h>
+#include <machdep.h>
 #include <output.h>
-#include <socketops.h>
 #include <transaction_factories.h>
 #include <transaction_handler.h>
-#include <transfer_handler.h>
 #include <util.h>
 #include <xmalloc.h>
 
 static pthread_key_t thread_key;
 static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
 
+/* With coroutines, each connection's transactions are handled in a
+   coroutine on a chat helper, which is suspended while a transaction for
+   another class of helper is handled there, and then carries on where it
+   left off on the same helper.  That keeps chat transactions on chat
+   helpers, but the other helper still blocks for as long as its
+   transaction takes, so it doesn't let more be in flight at once */
+static int coroutines = 0;
+static size_t coroutine_stack = DEFAULT_COROUTINE_STACK * 1024;
+
 static void thread_once_init(void)
 {
 	pthread_key_create(&thread_key, NULL);
 }
 
-static void ht_control_connect(int fd)
+static void ht_control_disconnect(int fd)
 {
-	char hello[8], *s;
-	uint16_t version;
+	tfm_purge_uid(fd);
+	cm_transaction_broadcast(fd, txn_part_create(fd));
+	cm_remove(fd);
+}
 
-	if(read_all(fd, hello, 8) < 0)
-		goto err;
+void ht_init()
+{
+	int i;
 
-	if(strncmp("TRTPHOTL", hello, 8)) 
-		goto err;
+	coroutines = (config_truth_value("threads", "coroutines") == 1);
 
-	if(read_int16(fd, &version) < 0) 
-		goto err;
+#ifndef HAVE_UCONTEXT
+	if(coroutines) {
+		log("!!! Warning: Coroutines are unsupported, ignoring threads::coroutines");
+		coroutines = 0;
+	}
+#endif
 
-	if(read_int16(fd, &version) < 0) 
-		goto err;
+	if((i = config_int_value("threads", "coroutine_stack")) < 1)
+		i = DEFAULT_COROUTINE_STACK;
+	coroutine_stack = (size_t)i * 1024;
+}
 
-	if(write_all(fd, "TRTP\0\0\0\0", 8) < 0)
-		goto err;
+/* Transactions left for another class of helper to carry on with */
+typedef struct _Resumption {
+	int fd;
+	TransactionBuffer b;
+} *Resumption;
 
-	multiplexer_add(fd, MPLX_RD);
+/* Transactions being handled in a coroutine, by the helper which owns it */
+typedef struct _Task {
+	int fd;
+	TransactionBuffer b;
 
-	return;
-err:
-	log("--- Disconnect: %s (%d) failed handshake", s = conn_ntoa(fd), fd);
-	xfree(s);
-	cm_remove(fd);
+	HThread owner;
+	Coroutine co;
 
-	close(fd);
+	/* The transaction another helper is handling, and its result */
+	TransactionIn t;
+	int ret;
+} *Task;
+
+/* Have a helper of class cls handle t, and carry on once it has */
+static int ht_offload(Task task, tm_class_t cls, TransactionIn t)
+{
+	task->t = t;
+
+	tm_suspend(task->owner);
+	tm_dispatch_ptr(cls, HT_OFFLOAD, task);
+	coroutine_yield();
+
+	return task->ret;
 }
 
-static void ht_data_connect(ConnectionInfo c)
+static void ht_offloaded(Task task)
 {
-	HThread t;
+	task->ret = th_exec(task->fd, task->t);
+	tm_resume(task->owner, HT_CONTINUE, task);
+}
+
+/* Handle the transactions in b, in the order they arrived.  When one is
+   for another class of helper, have that class handle it if we're in a
+   coroutine, or otherwise hand the rest over */
+static void ht_transactions(int fd, TransactionBuffer b, Task task)
+{
+	TransactionIn t;
+	Resumption r;
+	tm_class_t cls;
 	char *s;
-	int fd;
-	uint32_t ip, tid;
-#ifdef DEBUG
-	uint32_t v1, v2;
-#endif
-	uint8_t buffer[16];
+	int id, ret;
 
-	fd = c->fd;
-	ip = c->ip;
-	xfree(c);
+	cls = tm_class((HThread)pthread_getspecific(thread_key));
 
-	if(read_all(fd, buffer, 16) < 0) 
-		goto err;
+	while((id = transaction_buffer_peek(b)) >= 0) {
+		if(th_class(id) != cls && task == NULL) {
+			r = NEW(Resumption);
+			r->fd = fd;
+			r->b = b;
 
-	if(memcmp(buffer, "HTXF", 4)) 
-		goto err;
+			tm_dispatch_ptr(th_class(id), HT_RESUME, r);
+			return;
+		}
 
-	/* These are hopefully aligned properly... */
-	tid = ntohl(*(uint32_t *)(buffer + 4));
-#ifdef DEBUG
-	/* The purpose of these two values is unknown.  They're always zero */
-	v1 = ntohl(*(uint32_t *)(buffer + 8));
-	v2 = ntohl(*(uint32_t *)(buffer + 12));
+		if((t = transaction_buffer_next(b)) == NULL)
+			break;
 
-	debug("Got transfer: ID %d, v1: %d, v2: %d", tid, v1, v2);
-#endif
-	t = (HThread)pthread_getspecific(thread_key);
-	
-	if(tfm_register(tid, fd, ip, t) < 0)
+		if(th_class(id) != cls)
+			ret = ht_offload(task, th_class(id), t);
+		else
+			ret = th_exec(fd, t);
+
+		transaction_in_destroy(t);
+
+		if(ret < 0)
+			goto err;
+	}
+
+	if(transaction_buffer_failed(b))
 		goto err;
-		
-	xfer_wait(fd, tid);
+
+	transaction_buffer_destroy(b);
+	ch_rearm(fd);
 
 	return;
+
 err:
-	log("--- Disconnect: %s (%d) failed handshake", s = xinet_ntoa(ip), fd);
-	close(fd);
+	transaction_buffer_destroy(b);
+
+	log("--- Disconnect: %s (%d)", s = conn_ntoa(fd), fd);
+	xfree(s);
+
+	ht_control_disconnect(fd);
+	return;
 }
 
-static void ht_control_disconnect(int fd)
+static void ht_task_main(void *arg)
 {
-	tfm_purge_uid(fd);
-	cm_transaction_broadcast(fd, txn_part_create(fd));
-	cm_remove(fd);
+	Task task = (Task)arg;
+
+	ht_transactions(task->fd, task->b, task);
+}
+
+/* Run task until it's either suspended or done */
+static void ht_task_run(Task task)
+{
+	if(coroutine_resume(task->co)) {
+		coroutine_destroy(task->co);
+		xfree(task);
+	}
 }
 
+static Task ht_task_create(int fd, TransactionBuffer b)
+{
+	Task task;
+
+	task = NEW(Task);
+	task->fd = fd;
+	task->b = b;
+	task->owner = (HThread)pthread_getspecific(thread_key);
+
+	if((task->co = coroutine_create(ht_task_main, task, coroutine_stack)) == NULL) {
+		xfree(task);
+		return NULL;
+	}
+
+	return task;
+}
+
+/* Handle every transaction the event loop has buffered for a connection */
 static void ht_transaction(int fd)
 {
-	TransactionIn t;
-	char *s;
+	TransactionBuffer b;
+	Task task;
 
 #ifdef DEBUG
-	debug("*** Helper thread handling transaction");
+	debug("*** Helper thread handling transactions");
 #endif
 
-	if((t = transaction_read(fd)) == NULL)
-		goto err0;
+	/* Somebody else already disconnected it */
+	if((b = cm_input_take(fd)) == NULL)
+		return;
 
-	if(th_exec(fd, t) < 0)
-		goto err1;
+	if(coroutines && (task = ht_task_create(fd, b)) != NULL)
+		ht_task_run(task);
+	else
+		ht_transactions(fd, b, NULL);
+}
 
-	transaction_in_destroy(t);
-	multiplexer_add(fd, MPLX_RD);
+static void ht_resume(Resumption r)
+{
+	int fd;
+	TransactionBuffer b;
 
-	return;
+	fd = r->fd;
+	b = r->b;
+	xfree(r);
 
-err1:
-	transaction_in_destroy(t);
-err0:
-	log("--- Disconnect: %s (%d)", s = conn_ntoa(fd), fd);
-	xfree(s);
-
-	ht_control_disconnect(fd);
-	return;
+	ht_transactions(fd, b, NULL);
 }
 
-static int ht_exec(uint16_t id, MQBuf b)
+static void ht_exec(struct tm_job *j)
 {
-	switch(id) {
-		case HT_KILL:
-			return 0;
-		case HT_CONTROL_CONNECT:
-			ht_control_connect(mqbuf_message_intval(b));
+	switch(j->id) {
+		case HT_TRANSACTION:
+			ht_transaction(j->d.v);
 			break;
-		case HT_DATA_CONNECT:
-			ht_data_connect((ConnectionInfo)mqbuf_message_ptrval(b));
+		case HT_RESUME:
+			ht_resume((Resumption)j->d.p);
 			break;
-		case HT_TRANSACTION:
-			ht_transaction(mqbuf_message_intval(b));
+		case HT_OFFLOAD:
+			ht_offloaded((Task)j->d.p);
+			break;
+		case HT_CONTINUE:
+			ht_task_run((Task)j->d.p);
 			break;
-		case HT_UPLOAD:
-		case HT_DOWNLOAD:
-#ifdef DEBUG
-			debug("!!! INTERNAL INCONSISTENCY: Stray HT_UPLOAD/DOWNLOAD caught by helper thread's event handler.  This is most likely a transfer manager bug");
-#endif
-			return 1;
 	};
-
-	tm_return_thread((HThread)pthread_getspecific(thread_key));
-	return 1;
 }
 
 void *helper_thread(void *thread)
 {
 	HThread t = (HThread)thread;
-	MQBuf b;
+	struct tm_job j;
 
 	pthread_once(&thread_once, thread_once_init);
 	pthread_setspecific(thread_key, t);
-	mqueue_init(hthread_queue(t));
-	b = mqbuf_create();
+	tm_thread_init(t);
 
 #if DEBUG
 	debug("*** New helper thread ready");
 #endif
 
-	do mqueue_recv(b);
-	while(ht_exec(mqbuf_message_id(b), b));
+	while(tm_next_job(t, &j))
+		ht_exec(&j);
 
-	mqbuf_destroy(b);
+	hthread_free(t);
 
 	pthread_exit(NULL);
 }
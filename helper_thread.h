@@ -3,11 +3,7 @@
 
 #include <global.h>
 
-typedef struct _ConnectionInfo {
-	int fd;
-	uint32_t ip;
-} *ConnectionInfo;
-
+void ht_init();
 void *helper_thread(void *queue);
 
 #endif
@@ -1,15 +1,17 @@
+/* _GNU_SOURCE has to be defined before any system header for accept4() */
+#include <machdep.h>
 #include <global.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <listener.h>
 
-#define MAX_BACKLOG 256
-
-int listener_create(uint32_t source_addr, int port)
+int listener_create(uint32_t source_addr, int port, int reuseport, int backlog)
 {
 	int fd, val = 1;
 	struct sockaddr_in sin;
@@ -30,12 +32,29 @@ int listener_create(uint32_t source_addr, int port)
 		return -1;
 	}
 
+#ifdef SO_REUSEPORT
+	/* Lets every event loop bind its own listener to the same port */
+	if(reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0) {
+		perror("setsockopt");
+		return -1;
+	}
+#endif
+
+	/* Connections are accepted until the backlog is empty, so accept()
+	   mustn't block once it is */
+	if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		perror("fcntl");
+		return -1;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
 	if(bind(fd, (struct sockaddr *)&sin, sizeof(struct sockaddr_in)) < 0) {
 		perror("bind");
 		return -1;
 	}
 
-	if(listen(fd, MAX_BACKLOG) < 0) {
+	if(listen(fd, backlog) < 0) {
 		perror("listen");
 		return -1;
 	}
@@ -43,17 +62,39 @@ int listener_create(uint32_t source_addr, int port)
 	return fd;
 }
 
+/* Returns -1 once the backlog is empty.  Accepted sockets are non-blocking */
 int listener_accept(int fd, uint32_t *addr)
 {
 	int cfd;
 	struct sockaddr_in sin;
-	unsigned int len = sizeof(struct sockaddr_in);
+	socklen_t len = sizeof(struct sockaddr_in);
 
+#ifdef HAVE_ACCEPT4
+	if((cfd = accept4(fd, (struct sockaddr *)&sin, &len, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+		return -1;
+#else
 	if((cfd = accept(fd, (struct sockaddr *)&sin, &len)) < 0)
 		return -1;
 
+	fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+	fcntl(cfd, F_SETFD, FD_CLOEXEC);
+#endif
+
 	if(addr != NULL)
 		*addr = sin.sin_addr.s_addr;
 
 	return cfd;
 }
+
+/* Close a connection we've just accepted and won't take, with a reset, so
+   that nothing is left behind for it in TIME_WAIT */
+void listener_reject(int fd)
+{
+	struct linger l;
+
+	l.l_onoff = 1;
+	l.l_linger = 0;
+
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+	close(fd);
+}
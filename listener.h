@@ -1,7 +1,8 @@
 #ifndef LISTENER_H
 #define LISTENER_H
 
-int listener_create(uint32_t source_addr, int port);
+int listener_create(uint32_t source_addr, int port, int reuseport, int backlog);
 int listener_accept(int fd, uint32_t *addr);
+void listener_reject(int fd);
 	
 #endif
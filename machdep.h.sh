@@ -29,15 +29,21 @@ SunOS)
 	echo "/* #undef HAVE_VASPRINTF */"
 	echo "#define _POSIX_PTHREAD_SEMANTICS"
 	echo "#define _REENTRANT"
+	echo "#define HAVE_UCONTEXT 1"
 	;;
 Linux)
 	echo "/* #undef HAVE_SIGSET */"
 	echo "#define HAVE_VASPRINTF 1"
 	echo "#define _GNU_SOURCE 1"
+	echo "#define HAVE_EVENTFD 1"
+	echo "#define HAVE_ACCEPT4 1"
+	echo "#define HAVE_SCHED_SETAFFINITY 1"
+	echo "#define HAVE_UCONTEXT 1"
 	;;
 FreeBSD)
 	echo "/* #undef HAVE_SIGSET */"
 	echo "#define HAVE_VASPRINTF 1"
+	echo "#define HAVE_UCONTEXT 1"
 	;;
 OpenBSD)
 	echo "/* #undef HAVE_SIGSET */"
@@ -46,6 +52,7 @@ OpenBSD)
 NetBSD)
 	echo "/* #undef HAVE_SIGSET */"
 	echo "#define HAVE_VASPRINTF 1"
+	echo "#define HAVE_UCONTEXT 1"
 	;;
 *)
 	echo "/* #undef HAVE_SIGSET */"
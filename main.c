@@ -3,16 +3,18 @@
 #include <AccountManager.h>
 #include <Config.h>
 #include <ConnectionManager.h>
-#include <Multiplexer.h>
 #include <ThreadManager.h>
 #include <TransferManager.h>
+#include <admission.h>
 #include <connection_handler.h>
 #include <fileops.h>
 #include <global.h>
+#include <helper_thread.h>
 #include <log.h>
 #include <output.h>
 #include <tracker.h>
 #include <transaction_handler.h>
+#include <transfer_handler.h>
 
 #define CONFIG_FILE	"hotwired.conf"
 #if 0
@@ -52,12 +54,30 @@ static void server_init()
 	if(tm_init() < 0)
 		fatal("!!! Fatal error: Couldn't initialize thread manager");
 
+#ifdef DEBUG
+	debug("ht_init()");
+#endif
+	/* Set up the helper threads */
+	ht_init();
+
 #ifdef DEBUG
 	debug("am_init()");
 #endif
 	/* Initialize the account manager */
 	am_init();
 
+#ifdef DEBUG
+	debug("cm_init()");
+#endif
+	/* Initialize the connection manager */
+	cm_init();
+
+#ifdef DEBUG
+	debug("adm_init()");
+#endif
+	/* Set the limits on new connections */
+	adm_init();
+
 #ifdef DEBUG
 	debug("ch_init()");
 #endif
@@ -75,6 +95,12 @@ static void server_init()
 #endif
 	tfm_init();
 
+#ifdef DEBUG
+	debug("xfer_init()");
+#endif
+	/* Start the transfer engine */
+	xfer_init();
+
 #ifdef DEBUG
 	debug("tracker_init()");
 #endif
@@ -87,15 +113,9 @@ int main()
 	/* Initialize logfiles */
 	log_init();
 
-	/* Initialize multiplexer */
-	multiplexer_create();
-
 	/* Initialize the transaction handler */
 	th_init();
 
-	/* Initialize the connection manager */
-	cm_init();
-	
 	/* Call initializers which get re-called with SIGHUP */
 	server_init();
 
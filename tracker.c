@@ -11,6 +11,7 @@
 
 #include <Config.h>
 #include <ConnectionManager.h>
+#include <ThreadManager.h>
 #include <log.h>
 #include <tracker.h>
 #include <util.h>
@@ -132,6 +133,8 @@ static void *tracker_main(void *ptr)
 {
 	int sleep_period;
 
+	tm_bind_misc();
+
 	pthread_mutex_lock(&tlock);
 	log("*** Tracker thread started.  Updating %d trackers every %d seconds", tlist_count, update_interval);
 	
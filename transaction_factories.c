@@ -9,24 +9,18 @@
 TransactionOut txn_join_create(int uid)
 {
 	TransactionOut ret;
-	int16_t icon, status;
-	char *nickname;
+	struct conn_view v;
 
-	if(cm_getval(uid, CONN_ICON, &icon) < 0)
-		icon = 0;
-
-	if(cm_getval(uid, CONN_STATUS, &status) < 0)
-		status = 0;
-
-	cm_getval(uid, CONN_NICKNAME, &nickname);
+	if(cm_snapshot(uid, &v) < 0) {
+		v.icon = v.status = 0;
+		v.nickname[0] = '\0';
+	}
 
 	ret = transaction_create(HL_ADDUSER, 4);
 	transaction_add_int16(ret, HL_SOCKETNO, uid);
-	transaction_add_int16(ret, HL_ICON, icon);
-	transaction_add_int16(ret, HL_STATUS, status);
-	transaction_add_string(ret, HL_NICKNAME, nickname);
-
-	xfree(nickname);
+	transaction_add_int16(ret, HL_ICON, v.icon);
+	transaction_add_int16(ret, HL_STATUS, v.status);
+	transaction_add_string(ret, HL_NICKNAME, v.nickname);
 
 	return ret;
 }
@@ -11,6 +11,7 @@
 #include <Config.h>
 #include <ConnectionManager.h>
 #include <Permissions.h>
+#include <ThreadManager.h>
 #include <Transaction.h>
 #include <TransferManager.h>
 #include <fileops.h>
@@ -27,39 +28,42 @@
 struct th_list_element {
 	int16_t tid;
 	int (*handler)(int uid, TransactionIn);
+
+	/* Which helpers it's run by */
+	tm_class_t cls;
 };
 
 #define HANDLED_TRANSACTIONS	29
 struct th_list_element transaction_list[HANDLED_TRANSACTIONS] = {
-	{ HL_LOGIN, 		txn_login },
-	{ HL_INFO, 		txn_info },
-	{ HL_UPDATEUSER,	txn_info },
-	{ HL_USERLIST,		txn_userlist },
-	{ HL_FILELIST, 		txn_filelist },
-	{ HL_DOWNLOAD_FILE,	txn_download },
-	{ HL_UPLOAD_FILE, 	txn_upload },
-	{ HL_DOWNLOAD_FOLDER,	txn_download_folder },
-	{ HL_UPLOAD_FOLDER,	txn_upload_folder },
-	{ HL_CANCEL_TRANSFER,	txn_xfer_cancel },
-	{ HL_CREATE_FOLDER,	txn_create_folder },
-	{ HL_DELETE, 		txn_delete },
-	{ HL_MOVE,		txn_move },
-	{ HL_RENAME,		txn_rename },
-	{ HL_FILE_INFO,		txn_file_info },
-	{ HL_READ_ACCOUNT,	txn_read_account },
-	{ HL_CREATE_ACCOUNT,	txn_create_account },
-	{ HL_MODIFY_ACCOUNT,	txn_modify_account },
-	{ HL_DELETE_ACCOUNT,	txn_delete_account },
-	{ HL_ADMIN_ACCOUNTS,	txn_admin_accounts },
-	{ HL_ADMIN_SUBMIT,	txn_admin_submit },
-	{ HL_KICKUSER,		txn_kick_user },
-	{ HL_USERINFO,		txn_user_info },
-	{ HL_BROADCAST,		txn_broadcast },
-	{ HL_SENDCHAT,		txn_send_chat },
-	{ HL_SENDPM,		txn_send_privmsg },
-	{ HL_REQUEST_CHAT,	txn_request_chat },
-	{ HL_GET_NEWS_BUNDLE,	txn_get_news_bundle },
-	{ HL_PING, 		txn_ping }
+	{ HL_LOGIN, 		txn_login,	TM_CLASS_CHAT },
+	{ HL_INFO, 		txn_info,	TM_CLASS_CHAT },
+	{ HL_UPDATEUSER,	txn_info,	TM_CLASS_CHAT },
+	{ HL_USERLIST,		txn_userlist,	TM_CLASS_CHAT },
+	{ HL_FILELIST, 		txn_filelist,	TM_CLASS_FILES },
+	{ HL_DOWNLOAD_FILE,	txn_download,	TM_CLASS_FILES },
+	{ HL_UPLOAD_FILE, 	txn_upload,	TM_CLASS_FILES },
+	{ HL_DOWNLOAD_FOLDER,	txn_download_folder,	TM_CLASS_FILES },
+	{ HL_UPLOAD_FOLDER,	txn_upload_folder,	TM_CLASS_FILES },
+	{ HL_CANCEL_TRANSFER,	txn_xfer_cancel,	TM_CLASS_CHAT },
+	{ HL_CREATE_FOLDER,	txn_create_folder,	TM_CLASS_FILES },
+	{ HL_DELETE, 		txn_delete,	TM_CLASS_FILES },
+	{ HL_MOVE,		txn_move,	TM_CLASS_FILES },
+	{ HL_RENAME,		txn_rename,	TM_CLASS_FILES },
+	{ HL_FILE_INFO,		txn_file_info,	TM_CLASS_FILES },
+	{ HL_READ_ACCOUNT,	txn_read_account,	TM_CLASS_CHAT },
+	{ HL_CREATE_ACCOUNT,	txn_create_account,	TM_CLASS_CHAT },
+	{ HL_MODIFY_ACCOUNT,	txn_modify_account,	TM_CLASS_CHAT },
+	{ HL_DELETE_ACCOUNT,	txn_delete_account,	TM_CLASS_CHAT },
+	{ HL_ADMIN_ACCOUNTS,	txn_admin_accounts,	TM_CLASS_CHAT },
+	{ HL_ADMIN_SUBMIT,	txn_admin_submit,	TM_CLASS_CHAT },
+	{ HL_KICKUSER,		txn_kick_user,	TM_CLASS_CHAT },
+	{ HL_USERINFO,		txn_user_info,	TM_CLASS_CHAT },
+	{ HL_BROADCAST,		txn_broadcast,	TM_CLASS_CHAT },
+	{ HL_SENDCHAT,		txn_send_chat,	TM_CLASS_CHAT },
+	{ HL_SENDPM,		txn_send_privmsg,	TM_CLASS_CHAT },
+	{ HL_REQUEST_CHAT,	txn_request_chat,	TM_CLASS_CHAT },
+	{ HL_GET_NEWS_BUNDLE,	txn_get_news_bundle,	TM_CLASS_CHAT },
+	{ HL_PING, 		txn_ping,	TM_CLASS_CHAT }
 };
 
 Collection transaction_table;
@@ -94,23 +98,33 @@ void th_init()
 
 	transaction_table = collection_create();
 	for(i = 0; i < HANDLED_TRANSACTIONS; i++)
-		collection_insert(transaction_table, (CollectionKey)transaction_list[i].tid, (void *)transaction_list[i].handler);
+		collection_insert(transaction_table, (CollectionKey)transaction_list[i].tid, (void *)&transaction_list[i]);
 }
 
 int th_exec(int uid, TransactionIn t)
 {
-	int (*handler)(int, TransactionIn);
+	struct th_list_element *e;
 
 #ifdef DEBUG
 	transaction_print(t);
 #endif
 
-	if((handler = (int (*)(int, TransactionIn))collection_lookup(transaction_table, (CollectionKey)transaction_id(t))) == NULL) {
+	if((e = (struct th_list_element *)collection_lookup(transaction_table, (CollectionKey)transaction_id(t))) == NULL) {
 		reply_error(uid, t, "Error: Unsupported/unimplemented transaction: %d\n", transaction_id(t));
 		return 0;
 	}
 
-	return handler(uid, t);
+	return e->handler(uid, t);
+}
+
+tm_class_t th_class(uint16_t tid)
+{
+	struct th_list_element *e;
+
+	if((e = (struct th_list_element *)collection_lookup(transaction_table, (CollectionKey)tid)) == NULL)
+		return TM_CLASS_CHAT;
+
+	return e->cls;
 }
 
 int txn_login(int uid, TransactionIn t)
@@ -218,10 +232,9 @@ int txn_info(int uid, TransactionIn t)
 	int i;
 	uint16_t status = 0, status_bits;
 	uint16_t icon;
-	cstate_t cstate;
-	Permissions p;
+	struct conn_view v;
 
-	if((cstate = cm_get_cstate(uid)) == CSTATE_NL) {
+	if(cm_snapshot(uid, &v) < 0 || v.cstate == CSTATE_NL) {
 		reply_error(uid, t, "Not logged in.");
 		return 0;
 	}
@@ -243,22 +256,21 @@ int txn_info(int uid, TransactionIn t)
 			status |= HL_STATUS_NO_CHAT;
 	}
 
-	if(cstate == CSTATE_NR) 
+	if(v.cstate == CSTATE_NR) 
 		cm_set_cstate(uid, CSTATE_LI);
 
-	if((p = cm_perm_getall(uid)) == NULL)
+	if(!v.has_perms)
 		return -1;
 
-	if(permissions_is_superuser(p))
+	if(permissions_is_superuser(&v.perms))
 		status |= HL_STATUS_SUPERUSER;
 
-	if(permissions_is_operator(p))
+	if(permissions_is_operator(&v.perms))
 		status |= HL_STATUS_ADMIN;
 
-	if(permissions_is_visitor(p))
+	if(permissions_is_visitor(&v.perms))
 		status |= HL_STATUS_NOPERMISSIONS;
 
-	permissions_destroy(p);
 	cm_setval(uid, CONN_STATUS, &status);
 
 	reply_success(uid, t);
@@ -1368,11 +1380,10 @@ int txn_admin_submit(int uid, TransactionIn t)
 int txn_kick_user(int uid, TransactionIn t)
 {
 	int i, r;
-	char *s;
 	uint16_t uuid;
-	Permissions p;
+	struct conn_view v;
 	
-	if(cm_perm_check(uid, HL_PERM_DISCONNECT_USERS) < 1) {
+	if(cm_snapshot(uid, &v) < 0 || !v.has_perms || !permissions_check_field(&v.perms, HL_PERM_DISCONNECT_USERS)) {
 		reply_error(uid, t, "Error: You are not allowed to disconnect users.");
 		return 0;
 	}
@@ -1392,20 +1403,13 @@ int txn_kick_user(int uid, TransactionIn t)
 
 	if(!r) {
 		/* Superusers can disconnect anyone */
-		p = cm_perm_getall(uid);
-		r = permissions_is_superuser(p);
-		xfree(p);
-
-		if(!r) { 
+		if(!permissions_is_superuser(&v.perms)) { 
 			reply_error(uid, t, "Error: You are not allowed to disconnect the specified user"); 
 			return 0;
 		}
 	}
 
-	if(!cm_getval(uid, CONN_NICKNAME, &s)) { 
-		message_error(uuid, "Kicked by %s", s);
-		xfree(s);
-	}
+	message_error(uuid, "Kicked by %s", v.nickname);
 
 	tfm_purge_uid(uuid);
 	cm_transaction_broadcast(uuid, txn_part_create(uuid));
@@ -1430,16 +1434,17 @@ int txn_user_info(int uid, TransactionIn t)
 int txn_broadcast(int uid, TransactionIn t)
 {
 	int i;
-	char *message, *nickname;
+	char *message;
 	TransactionOut mtxn;
+	struct conn_view v;
+
+	if(cm_snapshot(uid, &v) < 0)
+		return -1;
 	
-	if(cm_perm_check(uid, HL_PERM_BROADCAST) < 1) {
+	if(!v.has_perms || !permissions_check_field(&v.perms, HL_PERM_BROADCAST)) {
 		reply_error(uid, t, "Error: You are not allowed to send broadcast messages.");
 		return 0;
 	}
-
-	if(cm_getval(uid, CONN_NICKNAME, &nickname) < 0) 
-		return -1;
 		
 	if((i = transaction_object_index(t, HL_MESSAGE)) < 0)
 		return 0;
@@ -1448,10 +1453,9 @@ int txn_broadcast(int uid, TransactionIn t)
 
 	mtxn = transaction_create(HL_BROADCAST, 3);
 	transaction_add_int16(mtxn, HL_SOCKETNO, uid);
-	transaction_add_string(mtxn, HL_NICKNAME, nickname);
+	transaction_add_string(mtxn, HL_NICKNAME, v.nickname);
 	transaction_add_string(mtxn, HL_MESSAGE, message);
 
-	xfree(nickname);
 	xfree(message);
 
 	cm_transaction_broadcast(uid, mtxn);
@@ -1463,34 +1467,31 @@ int txn_broadcast(int uid, TransactionIn t)
 int txn_send_chat(int uid, TransactionIn t)
 {
 	int i;
-	char *message, *nickname, *outbuf;
+	char *message, *outbuf;
 	TransactionOut mtxn;
+	struct conn_view v;
 
-	if(cm_perm_check(uid, HL_PERM_SEND_CHAT) < 1) 
-		return 0;
-
-	if(cm_getval(uid, CONN_NICKNAME, &nickname) < 0)
+	if(cm_snapshot(uid, &v) < 0)
 		return -1;
 
+	if(!v.has_perms || !permissions_check_field(&v.perms, HL_PERM_SEND_CHAT)) 
+		return 0;
+
 	if((i = transaction_object_index(t, HL_MESSAGE)) < 0) 
 		return 0;
 
 	if(transaction_object_len(t, i) > MAX_CHAT_MESSAGE_LEN) 
 		return 0;
 
-	if(cm_getval(uid, CONN_NICKNAME, &nickname) < 0) 
-		return -1;
-
 	message = transaction_object_string(t, i);
 
 	if((i = transaction_object_index(t, HL_EMOTE)) >= 0 && transaction_object_int16(t, i)) 
-		outbuf = xasprintf("\015* %s %s", nickname, message);
+		outbuf = xasprintf("\015* %s %s", v.nickname, message);
 	else
-		outbuf = xasprintf("\015<%s> %s", nickname, message);
+		outbuf = xasprintf("\015<%s> %s", v.nickname, message);
 
 
 	xfree(message);
-	xfree(nickname);
 
 	mtxn = transaction_create(HL_RELAYCHAT, 1);
 	transaction_add_string(mtxn, HL_MESSAGE, outbuf);
@@ -1,11 +1,15 @@
 #ifndef TRANSACTION_HANDLER_H
 #define TRANSACTION_HANDLER_H
 
+#include <ThreadManager.h>
 #include <Transaction.h>
 
 void th_init();
 int th_exec(int uid, TransactionIn t);
 
+/* Which helpers should run transactions with the given ID */
+tm_class_t th_class(uint16_t tid);
+
 /* Transaction handlers */
 int txn_login(int uid, TransactionIn t);
 int txn_info(int uid, TransactionIn t);
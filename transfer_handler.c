@@ -1,18 +1,24 @@
 #include <global.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/time.h>
+#include <arpa/inet.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
 
+#include <Collection.h>
 #include <Config.h>
-#include <MQueue.h>
+#include <CpuSet.h>
+#include <Multiplexer.h>
+#include <TimerWheel.h>
 #include <TransferManager.h>
+#include <atomic.h>
 #include <log.h>
 #include <machdep.h>
 #include <output.h>
-#include <socketops.h>
 #include <transfer_handler.h>
 #include <util.h>
 #include <xmalloc.h>
@@ -23,27 +29,110 @@
 #endif
 
 /* Size of transfer buffers (Must be >= 256) */
-#define BUFFER_SIZE	512
+#define BUFFER_SIZE	16384
+
+/* Most buffers moved per event, so that one fast client can't starve the
+   other transfers sharing its loop */
+#define XFER_BURST	16
+
+/* Largest number of events handled per trip through the multiplexer */
+#define EVENT_BATCH	64
 
 /* How long to wait for a data socket to close (in seconds) */
 #define CLOSE_TIMEOUT	30
 
+/* A data connection opens with "HTXF", the transfer ID, and two values
+   which always seem to be zero */
+#define HELLO_SIZE	16
+
+/* An upload opens with a 108 byte header and the length of an info block,
+   which is followed by 14 more bytes and the size of the file */
+#define UPLOAD_HEADER_SIZE	112
+#define MAX_UPLOAD_INFO		242
+
+/*
+   Each transfer engine loop has its own multiplexer and timer wheel, and
+   drives every data connection whose descriptor maps to it.  A transfer
+   moves through these states, and never blocks the loop on its socket:
+
+   XS_HELLO	Reading the hello on a newly accepted data connection.  Once
+		it's here the connection is registered with the transfer
+		manager, which keeps it until the transfer is activated
+   XS_HEADER	Activated.  A download opens its file, an upload reads the
+		client's header
+   XS_BODY	Moving the file
+   XS_LINGER	A finished download waiting for the client to close
+*/
+
+typedef enum {
+	XS_HELLO,
+	XS_HEADER,
+	XS_BODY,
+	XS_LINGER
+} xstate_t;
+
+typedef struct _XferLoop {
+	Multiplexer m;
+	TimerWheel timers;
+
+	/* Transfers by descriptor */
+	Collection xfers;
+	pthread_mutex_t lock;
+
+	pthread_t tid;
+} *XferLoop;
+
+struct _Xfer {
+	struct _XferLoop *l;
+	int fd;
+	uint32_t ip;
+
+	xstate_t state;
+	int upload;
+	TransferInfo d;
+
+	/* The local file, and how much of it is left to move */
+	int file;
+	char *partial;
+	uint32_t remaining;
+
+	/* Downloads send [start, end).  Headers are read into [0, end) until
+	   it reaches want */
+	uint8_t *buf;
+	int start, end, want;
+
+	/* The transfer is dropped if it makes no progress for a whole
+	   period of its timer */
+	Timer timer;
+	int progress;
+
+	/* Set by xfer_abort() */
+	int aborted;
+};
+
+static XferLoop loops = NULL;
+static int loop_count = 0;
+
+/* CPUs the loops are bound to, one each */
+static CpuSet io_cpus = NULL;
+
 /* XXX Hotline has this propensity to litter everything with a bunch of
    values which seem to do nothing and are always zero.  So, the header
    starts zeroed and the values that actually seem to hold some significance
-   are initialized.  I've picked through this header in a sniffer again and 
+   are initialized.  I've picked through this header in a sniffer again and
    as far as I can tell this should be complete, but Pitbull Pro is complaining
    that the header is malformed.  If you see any inconsistancies in the
    contruction of this header pleace inform me.
  */
-static void xfer_dl_header(int fd, char *filename, int length)
+static int xfer_dl_header(uint8_t *header, char *filename, int length)
 {
 	int l;
-	uint8_t *header;
 
 	l = strlen(filename);
 
-	header = (uint8_t *)xmalloc(130 + l);
+	if(130 + l > BUFFER_SIZE)
+		return -1;
+
 	memset(header, '\0', 130 + l);
 
 	/* File transfer header */
@@ -79,8 +168,7 @@ static void xfer_dl_header(int fd, char *filename, int length)
 	/* Number of bytes to be transfered */
 	mcpy_int32(header + 126 + l, length);
 
-	write_all(fd, header, 130 + l);
-	xfree(header);
+	return 130 + l;
 }
 
 #ifdef DEBUG
@@ -100,184 +188,615 @@ static void display_data(uint8_t *buf, int len)
 }
 #endif
 
-/* XXX Most of the values in this header are unknown and therefore ignored */
-static void xfer_upload(int sock, int tid, TransferInfo d)
+static void xfer_wakeup(void *ptr)
 {
-	int fd, umask, n;
-	char *filename;
-	uint32_t len;
-	uint8_t buf[BUFFER_SIZE];
+	multiplexer_wakeup((Multiplexer)ptr);
+}
+
+static void xfer_expire(void *arg);
+
+static Xfer xfer_create(int fd, uint32_t ip, xstate_t state, int timeout)
+{
+	Xfer x;
+
+	x = NEW(Xfer);
+	x->l = &loops[fd % loop_count];
+	x->fd = fd;
+	x->ip = ip;
+	x->state = state;
+	x->upload = 0;
+	x->d = NULL;
+	x->file = -1;
+	x->partial = NULL;
+	x->remaining = 0;
+	x->buf = state == XS_HELLO ? (uint8_t *)xmalloc(HELLO_SIZE) : NULL;
+	x->start = x->end = x->want = 0;
+	x->progress = 0;
+	x->aborted = 0;
+	x->timer = timerwheel_add(x->l->timers, timeout * 1000, xfer_expire, x);
+
+	return x;
+}
+
+/* Start watching x's descriptor */
+static void xfer_add(Xfer x, mevent_t event)
+{
+	XferLoop l = x->l;
+
+	pthread_mutex_lock(&l->lock);
+	collection_insert(l->xfers, x->fd, x);
+	pthread_mutex_unlock(&l->lock);
+
+	multiplexer_add_mode(l->m, x->fd, event, MPLX_ONESHOT);
+}
+
+static mevent_t xfer_event(Xfer x)
+{
+	if(x->state == XS_HELLO || x->state == XS_LINGER || x->upload)
+		return MPLX_RD;
+
+	return MPLX_WR;
+}
+
+/* Stop watching x's descriptor and free it, leaving the descriptor open */
+static void xfer_free(Xfer x)
+{
+	XferLoop l = x->l;
+
+	pthread_mutex_lock(&l->lock);
+	collection_remove(l->xfers, x->fd);
+	pthread_mutex_unlock(&l->lock);
+
+	multiplexer_remove(l->m, x->fd, xfer_event(x));
+
+	/* Fails harmlessly if we were called by the timer itself */
+	if(x->timer != NULL)
+		timerwheel_cancel(x->timer);
 
-	filename = xasprintf("%s.hpf", d->filename);
+	if(x->file != -1)
+		close(x->file);
 
+	if(x->partial != NULL)
+		xfree(x->partial);
+
+	if(x->d != NULL) {
+		xfree(x->d->filename);
+		xfree(x->d);
+	}
+
+	xfree(x->buf);
+	xfree(x);
+}
+
+static void xfer_close(Xfer x)
+{
+	int fd = x->fd;
+
+	xfer_free(x);
+	close(fd);
+}
+
+/* Give the transfer's slot back, unless the transfer manager has already
+   dropped it */
+static void xfer_complete(Xfer x)
+{
+	if(!ATOMIC_LOAD(&x->aborted))
+		tfm_complete(x->d->tid, x);
+}
+
+static void xfer_upload_done(Xfer x, int ok)
+{
+	if(x->file != -1) {
+		close(x->file);
+		x->file = -1;
+	}
+
+	if(ok) {
+		link(x->partial, x->d->filename);
+		unlink(x->partial);
+
+		log("*** Upload (TID: %d) to %s completeted successfully", x->d->tid, x->d->filename);
+	} else {
+		log("*** Upload (TID: %d) to %s failed.", x->d->tid, x->d->filename);
+
+		if(x->state == XS_BODY && config_truth_value("transfers", "remove_partials") == 1)
+			unlink(x->partial);
+	}
+
+	xfer_complete(x);
+	xfer_close(x);
+}
+
+static void xfer_download_done(Xfer x, int ok)
+{
+	XferLoop l = x->l;
+
+	if(x->file != -1) {
+		close(x->file);
+		x->file = -1;
+	}
+
+	if(!ok) {
+		log("*** Download (TID: %d) from %s failed", x->d->tid, x->d->filename);
+
+		xfer_complete(x);
+		xfer_close(x);
+		return;
+	}
+
+	log("*** Download (TID: %d) from %s completed", x->d->tid, x->d->filename);
+
+	/* The slot is free straight away, but the connection is ours until
+	   it's closed */
+	xfer_complete(x);
+
+	/* I believe there is a race condition in the official Hotline client
+	   wherein even if all the bytes for a given transfer have been
+	   written to the data socket, if the connection is closed too soon
+	   the client will believe the transwer was prematurely terminated.
+	   In order to solve this, we wait a specified amount of time for
+	   the connection to close */
+	multiplexer_remove(l->m, x->fd, MPLX_WR);
+	x->state = XS_LINGER;
+
+	if(x->timer != NULL)
+		timerwheel_cancel(x->timer);
+
+	x->timer = timerwheel_add(l->timers, CLOSE_TIMEOUT * 1000, xfer_expire, x);
+	multiplexer_add_mode(l->m, x->fd, MPLX_RD, MPLX_ONESHOT);
+}
+
+static void xfer_done(Xfer x, int ok)
+{
+	if(x->upload)
+		xfer_upload_done(x, ok);
+	else
+		xfer_download_done(x, ok);
+}
+
+static void xfer_expire(void *arg)
+{
+	Xfer x = (Xfer)arg;
+	char *s;
+
+	x->timer = NULL;
+
+	if(x->progress && x->state != XS_LINGER) {
+		x->progress = 0;
+		x->timer = timerwheel_add(x->l->timers, RESPONSE_TIMEOUT * 1000, xfer_expire, x);
+		return;
+	}
+
+	switch(x->state) {
+		case XS_HELLO:
+			log("--- Disconnect: %s (%d) failed handshake", s = xinet_ntoa(x->ip), x->fd);
+			xfree(s);
+
+			/* Fall through */
+		case XS_LINGER:
+			xfer_close(x);
+			break;
+		default:
+			xfer_done(x, 0);
+	}
+}
+
+/* Wait for the descriptor to be ready again */
+static void xfer_rearm(Xfer x)
+{
+	multiplexer_rearm(x->l->m, x->fd, xfer_event(x));
+}
+
+/* Read into x->buf until it holds x->want bytes.  Returns 1 once it does,
+   0 if it's waiting for more, or -1 if the connection failed */
+static int xfer_read_header(Xfer x)
+{
+	ssize_t r;
+
+	while(x->end < x->want) {
+		if((r = recv(x->fd, x->buf + x->end, x->want - x->end, 0)) > 0) {
+			x->end += r;
+			x->progress = 1;
+			continue;
+		}
+
+		if(r < 0 && errno == EINTR)
+			continue;
+
+		if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			xfer_rearm(x);
+			return 0;
+		}
+
+		return -1;
+	}
+
+	return 1;
+}
+
+static void xfer_hello(Xfer x)
+{
+	int fd, tid;
+	uint32_t ip, v32;
+	char *s;
 #ifdef DEBUG
-	debug("Starting upload: %s (offset: %d)", d->filename, d->offset);
-	debug("to file: %s", filename);
+	uint32_t v1, v2;
 #endif
-	if(read_all(sock, buf, 108) < 0)
-		goto done;
+
+	x->want = HELLO_SIZE;
+
+	switch(xfer_read_header(x)) {
+		case 0:
+			return;
+		case -1:
+			goto err;
+	}
+
+	if(memcmp(x->buf, "HTXF", 4))
+		goto err;
+
+	/* Logged here rather than on accept, which is kept to handing the
+	   connection off so the listener gets back to draining its queue */
+	log("+++ Connect: %s on data port (%d)", s = xinet_ntoa(x->ip), x->fd);
+	xfree(s);
+
+	memcpy(&v32, x->buf + 4, 4);
+	tid = ntohl(v32);
+#ifdef DEBUG
+	/* The purpose of these two values is unknown.  They're always zero */
+	memcpy(&v32, x->buf + 8, 4);
+	v1 = ntohl(v32);
+	memcpy(&v32, x->buf + 12, 4);
+	v2 = ntohl(v32);
+
+	debug("Got transfer: ID %d, v1: %d, v2: %d", tid, v1, v2);
+#endif
+	fd = x->fd;
+	ip = x->ip;
+
+	/* The transfer may be queued, so the connection waits with it until
+	   it's activated, and comes back to us then */
+	xfer_free(x);
+
+	if(tfm_register(tid, fd, ip) < 0) {
+		log("--- Disconnect: %s (%d) failed handshake", s = xinet_ntoa(ip), fd);
+		xfree(s);
+
+		close(fd);
+	}
+
+	return;
+err:
+	log("--- Disconnect: %s (%d) failed handshake", s = xinet_ntoa(x->ip), x->fd);
+	xfree(s);
+
+	xfer_close(x);
+}
+
+/* Returns 0 once the header's done and the body can follow, or -1 if
+   it's still to come or the upload has failed */
+
+/* XXX Most of the values in this header are unknown and therefore ignored */
+static int xfer_upload_header(Xfer x)
+{
+	TransferInfo d = x->d;
+	uint32_t len;
+	int umask;
+
+	if(x->want == 0)
+		x->want = UPLOAD_HEADER_SIZE;
+
+	if(x->want == UPLOAD_HEADER_SIZE) {
+		switch(xfer_read_header(x)) {
+			case 0:
+				return -1;
+			case -1:
+				goto err;
+		}
 
 #ifdef DEBUG
-	display_data(buf, 108);
+		display_data(x->buf, 108);
 #endif
 
-	if(strncmp((char *)buf, "FILP", 4) < 0)
-		goto done;
+		if(strncmp((char *)x->buf, "FILP", 4) < 0)
+			goto err;
 
-	if(read_int32(sock, &len) < 0)
-		goto done;
+		memcpy(&len, x->buf + 108, 4);
+		len = ntohl(len);
 
 #ifdef DEBUG
-	debug("Remaining block length: %d", len);
+		debug("Remaining block length: %d", len);
 #endif
 
-	if(len > 242) {
+		if(len > MAX_UPLOAD_INFO) {
 #ifdef DEBUG
-		debug("Received malformed transfer header with bogus length value");
+			debug("Received malformed transfer header with bogus length value");
 #endif
-		goto done;
+			goto err;
+		}
+
+		x->want = UPLOAD_HEADER_SIZE + len + 14 + 4;
 	}
 
-	if(read_all(sock, buf, len + 14) < 0)
-		goto done;
+	switch(xfer_read_header(x)) {
+		case 0:
+			return -1;
+		case -1:
+			goto err;
+	}
 
 #ifdef DEBUG
-	display_data(buf, len + 14);
+	display_data(x->buf + UPLOAD_HEADER_SIZE, x->want - UPLOAD_HEADER_SIZE - 4);
 #endif
 
-	if(read_int32(sock, &len) < 0)
-		goto done;
+	memcpy(&len, x->buf + x->want - 4, 4);
+	x->remaining = ntohl(len);
 
 #ifdef DEBUG
-	debug("File size: %d bytes", len);
+	debug("File size: %d bytes", x->remaining);
 #endif
 
 	if(!d->mode) {
 		if((umask = config_int_value("transfers", "file_umask")) < 0)
 			umask = 0644;
 
-		if((fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, umask)) < 0) 
-			goto done;
+		if((x->file = open(x->partial, O_CREAT | O_WRONLY | O_TRUNC, umask)) < 0)
+			goto err;
 	} else {
-		if((fd = open(filename, O_WRONLY)) < 0)
-			goto done;
+		if((x->file = open(x->partial, O_WRONLY)) < 0)
+			goto err;
 
-		lseek(fd, d->offset, SEEK_SET);
+		lseek(x->file, d->offset, SEEK_SET);
 	}
 
-	log("*** Beginning upload (TID: %d) to %s (%d bytes)", tid, d->filename, len);
+	log("*** Beginning upload (TID: %d) to %s (%d bytes)", d->tid, d->filename, x->remaining);
 
-	while(len > 0) {
-		n = BUFFER_SIZE > len ? len : BUFFER_SIZE;
+	x->state = XS_BODY;
+	x->start = x->end = 0;
 
-		if(read_all(sock, buf, n) < 0) 
-			goto err;
+	return 0;
+err:
+	xfer_done(x, 0);
+	return -1;
+}
 
-		if(write(fd, buf, n) < 0) 
-			goto err;
+static void xfer_upload_body(Xfer x)
+{
+	ssize_t r;
+	int i;
 
-		len -= n;
-	}
+	for(i = 0; i < XFER_BURST; i++) {
+		if(x->remaining == 0) {
+			xfer_done(x, 1);
+			return;
+		}
 
-	close(fd);
-	link(filename, d->filename);
-	unlink(filename);
+		if((r = recv(x->fd, x->buf, x->remaining > BUFFER_SIZE ? BUFFER_SIZE : x->remaining, 0)) < 0) {
+			if(errno == EINTR)
+				continue;
 
-	log("*** Upload (TID: %d) to %s completeted successfully", tid, d->filename);
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+		}
 
-	goto done;
-err:
-	log("*** Upload (TID: %d) to %s failed.", tid, d->filename);
-	close(fd);
+		if(r < 1 || write(x->file, x->buf, r) != r) {
+			xfer_done(x, 0);
+			return;
+		}
 
-	if(config_truth_value("transfers", "remove_partials") == 1)
-		unlink(filename);
-done:
-	xfree(filename);
-	xfree(d->filename);
-	xfree(d);
+		x->remaining -= r;
+		x->progress = 1;
+	}
 
-	tfm_remove(tid);
+	xfer_rearm(x);
 }
 
-static void xfer_download(int sock, int tid, TransferInfo d)
+static int xfer_download_header(Xfer x)
 {
-	/* Variables for a file transfer */
-	int fd, n, len;
+	TransferInfo d = x->d;
 	struct stat st;
-	char buf[BUFFER_SIZE];
+	int len;
 
-	/* Variables for close timeout */
-	fd_set fdset;
-	struct timeval tv;
-	
 #ifdef DEBUG
 	debug("Beginning download...");
 #endif
-	if((fd = open(d->filename, O_RDONLY)) < 0)
-		goto done;
+	if((x->file = open(d->filename, O_RDONLY)) < 0)
+		goto err;
 
-	if(fstat(fd, &st) < 0)
-		goto done;
+	if(fstat(x->file, &st) < 0)
+		goto err;
 
 	if((len = st.st_size - d->offset) < 0)
-		goto done;
+		goto err;
 
-	log("*** Beginning download (TID: %d) from %s (%d bytes)", tid, d->filename, len);
+	log("*** Beginning download (TID: %d) from %s (%d bytes)", d->tid, d->filename, len);
 
-	if(!d->mode)
-		xfer_dl_header(sock, d->filename, len);
+	x->start = x->end = 0;
+	x->remaining = len;
+
+	if(!d->mode && (x->end = xfer_dl_header(x->buf, d->filename, len)) < 0)
+		goto err;
 
 	if(d->offset)
-		lseek(fd, d->offset, SEEK_SET);
+		lseek(x->file, d->offset, SEEK_SET);
 
-	while(len > 0) {
-		if((n = read(fd, buf, BUFFER_SIZE > len ? len : BUFFER_SIZE)) < 1)
-			goto done;
+	x->state = XS_BODY;
 
-		if(write_all(sock, buf, n) < 0)
-			goto done;
+	return 0;
+err:
+	xfer_done(x, 0);
+	return -1;
+}
 
-		len -= n;
-	}
+static void xfer_download_body(Xfer x)
+{
+	ssize_t r;
+	int i;
 
-	close(fd);
+	for(i = 0; i < XFER_BURST; i++) {
+		if(x->start == x->end) {
+			if(x->remaining == 0) {
+				xfer_done(x, 1);
+				return;
+			}
 
-	/* I believe there is a race condition in the official Hotline client
-	   wherein even if all the bytes for a given transfer have been
-	   written to the data socket, if the connection is closed too soon
-	   the client will believe the transwer was prematurely terminated.
-	   In order to solve this, we wait a specified amount of time for
-	   the connection to close */
+			if((r = read(x->file, x->buf, x->remaining > BUFFER_SIZE ? BUFFER_SIZE : x->remaining)) < 1) {
+				xfer_done(x, 0);
+				return;
+			}
+
+			x->start = 0;
+			x->end = r;
+			x->remaining -= r;
+		}
 
-	tv.tv_sec = CLOSE_TIMEOUT;
-	tv.tv_usec = 0;
+		if((r = send(x->fd, x->buf + x->start, x->end - x->start, 0)) < 0) {
+			if(errno == EINTR)
+				continue;
 
-	FD_ZERO(&fdset);
-	FD_SET(sock, &fdset);
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
 
-	select(sock + 1, &fdset, NULL, NULL, &tv);
-done:
-	log("*** Download (TID: %d) from %s completed", tid, d->filename);
+			xfer_done(x, 0);
+			return;
+		}
 
-	xfree(d->filename);
-	xfree(d);
+		x->start += r;
+		x->progress = 1;
+	}
 
-	tfm_remove(tid);
+	xfer_rearm(x);
 }
 
-void xfer_wait(int fd, int tid)
+static void xfer_ready(Xfer x)
 {
-	MQBuf b;
+	/* The buffer is allocated, and first touched, by the thread which
+	   uses it, so that it's in memory local to that thread's CPU */
+	if(x->buf == NULL)
+		x->buf = (uint8_t *)xmalloc(BUFFER_SIZE);
+
+	/* The transfer manager has dropped it */
+	if(ATOMIC_LOAD(&x->aborted) && x->state != XS_LINGER) {
+		xfer_done(x, 0);
+		return;
+	}
 
-	b = mqbuf_create();
-	mqueue_recv(b);
-	switch(mqbuf_message_id(b)) {
-		case HT_UPLOAD:
-			xfer_upload(fd, tid, (TransferInfo)mqbuf_message_ptrval(b));
+	switch(x->state) {
+		case XS_HELLO:
+			xfer_hello(x);
+			break;
+		case XS_HEADER:
+			if((x->upload ? xfer_upload_header(x) : xfer_download_header(x)) < 0)
+				break;
+
+			/* Carry straight on with the body */
+		case XS_BODY:
+			if(x->upload)
+				xfer_upload_body(x);
+			else
+				xfer_download_body(x);
+			break;
+		case XS_LINGER:
+			/* The client has either closed the connection or sent
+			   something, and either way we're done with it */
+			xfer_close(x);
 			break;
-		case HT_DOWNLOAD:
-			xfer_download(fd, tid, (TransferInfo)mqbuf_message_ptrval(b));
 	}
-	mqbuf_destroy(b);
+}
+
+static void *xfer_loop(void *loop)
+{
+	XferLoop l = (XferLoop)loop;
+	struct mevent ev[EVENT_BATCH];
+	int i, n;
+	Xfer x;
+
+	if((n = cpuset_bind(io_cpus, l - loops)) >= 0)
+		log("*** Transfer thread %d bound to CPU %d", (int)(l - loops), n);
+
+	for(;;) {
+		n = multiplexer_poll_many(l->m, ev, EVENT_BATCH, timerwheel_next(l->timers));
+		timerwheel_run(l->timers);
+
+		for(i = 0; i < n; i++) {
+			pthread_mutex_lock(&l->lock);
+			x = collection_lookup(l->xfers, ev[i].fd);
+			pthread_mutex_unlock(&l->lock);
+
+			if(x != NULL)
+				xfer_ready(x);
+		}
+	}
+
+	return NULL;
+}
+
+void xfer_init()
+{
+	int i;
+
+	/* The number of loops is fixed once the server is running */
+	if(loops != NULL)
+		return;
+
+	if((loop_count = config_int_value("transfers", "io_threads")) < 1)
+		loop_count = DEFAULT_XFER_THREADS;
+
+	loops = NEWV(XferLoop, loop_count);
+	io_cpus = cpuset_config("io_cpus");
+
+	for(i = 0; i < loop_count; i++) {
+		loops[i].m = multiplexer_create();
+		loops[i].timers = timerwheel_create(xfer_wakeup, loops[i].m);
+		loops[i].xfers = collection_create();
+		pthread_mutex_init(&loops[i].lock, NULL);
+
+		if(pthread_create(&loops[i].tid, NULL, xfer_loop, &loops[i]))
+			fatal("!!! Fatal error: Couldn't start transfer thread");
+	}
+}
+
+void xfer_accept(int fd, uint32_t ip)
+{
+	xfer_add(xfer_create(fd, ip, XS_HELLO, RESPONSE_TIMEOUT), MPLX_RD);
+}
+
+static Xfer xfer_start(TransferInfo d, int upload)
+{
+	Xfer x;
+
+	x = xfer_create(d->fd, 0, XS_HEADER, RESPONSE_TIMEOUT);
+	x->upload = upload;
+	x->d = d;
+
+	if(upload) {
+		x->partial = xasprintf("%s.hpf", d->filename);
+
+#ifdef DEBUG
+		debug("Starting upload: %s (offset: %d)", d->filename, d->offset);
+		debug("to file: %s", x->partial);
+#endif
+	}
+
+	xfer_add(x, xfer_event(x));
+
+	return x;
+}
+
+Xfer xfer_upload(TransferInfo d)
+{
+	return xfer_start(d, 1);
+}
+
+Xfer xfer_download(TransferInfo d)
+{
+	return xfer_start(d, 0);
+}
+
+void xfer_abort(Xfer x)
+{
+	ATOMIC_STORE(&x->aborted, 1);
+
+	/* Wake the loop up, if it's waiting on the connection */
+	shutdown(x->fd, SHUT_RDWR);
 }
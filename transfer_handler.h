@@ -1,12 +1,35 @@
 #ifndef TRANSFER_HANDLER_H
 #define TRANSFER_HANDLER_H
 
+#include <global.h>
+
+/* Transfers are driven by a few I/O threads of their own, each of which
+   multiplexes many data connections */
+typedef struct _Xfer *Xfer;
+
+/* An activated transfer, and the data connection it runs over */
 typedef struct _TransferInfo {
+	int fd;
+	int tid;
+
 	char *filename;
 	int mode;
 	int offset;
 } *TransferInfo;
 
-void xfer_wait(int fd, int tid);
+void xfer_init();
+
+/* Take a newly accepted data connection, and register it with the
+   transfer manager once its hello arrives */
+void xfer_accept(int fd, uint32_t ip);
+
+/* Start an activated transfer, which owns d and its connection from here
+   on.  Once it's finished it calls tfm_complete() */
+Xfer xfer_upload(TransferInfo d);
+Xfer xfer_download(TransferInfo d);
+
+/* Drop a transfer the transfer manager has given up on.  It doesn't call
+   tfm_complete() */
+void xfer_abort(Xfer x);
 	
 #endif
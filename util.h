@@ -11,4 +11,8 @@ struct hostent *xgethostbyname(const char *name);
 void mcpy_int16(uint8_t *ptr, int16_t value);
 void mcpy_int32(uint8_t *ptr, int32_t value);
 
+/* Milliseconds from some fixed point, which never goes backwards where
+   the system has a monotonic clock */
+uint64_t now_msec(void);
+
 #endif